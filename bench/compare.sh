@@ -0,0 +1,64 @@
+#!/bin/sh
+# Compares benchmark results with a stored baseline, both one JSON line per run.
+# The best run of each benchmark counts. Throughput and latencies may deviate by the
+# tolerance in percent, counts must match exactly. Exits with 1 if a number got worse.
+#
+# usage: compare.sh <baseline> <results> [tolerance]
+
+if [ $# -lt 2 ] || [ ! -r "$1" ] || [ ! -r "$2" ]; then
+    echo "usage: $0 <baseline> <results> [tolerance]"
+    exit 2
+fi
+
+awk -v base="$1" -v tolerance="${3:-15}" '
+# 1 if more is better, -1 if less is better, 0 if the value has to stay the same
+function direction(key) {
+    if (key ~ /per_second$/) return(1)
+    if (key ~ /^(messages|evaluations|commands|rounds|tick_ms)$/) return(0)
+    return(-1)
+}
+
+{
+    if (!match($0, /"benchmark":"[a-z0-9]+"/)) next
+    name = substr($0, RSTART + 13, RLENGTH - 14)
+    line = $0
+    while (match(line, /"[a-z0-9_]+":-?[0-9.]+/)) {
+        pair = substr(line, RSTART + 1, RLENGTH - 1)
+        line = substr(line, RSTART + RLENGTH)
+        key = substr(pair, 1, index(pair, "\"") - 1)
+        value = substr(pair, index(pair, ":") + 1) + 0
+        if (key == "seconds") continue
+        id = name "." key
+        d = direction(key)
+        if (FILENAME == base) {
+            if (!(id in old)) order[++count] = id
+            if (!(id in old) || (d * value > d * old[id])) old[id] = value
+            names[name] = 1
+        } else {
+            if (!(id in new) || (d * value > d * new[id])) new[id] = value
+            measured[name] = 1
+        }
+    }
+}
+
+END {
+    worse = 0
+    for (name in names)
+        if (!(name in measured)) printf("%s: skipped\n", name)
+    for (name in measured)
+        if (!(name in names)) printf("%s: not in the baseline, not compared\n", name)
+    for (i = 1; i <= count; i++) {
+        id = order[i]
+        if (!(id in new)) continue
+        key = substr(id, index(id, ".") + 1)
+        d = direction(key)
+        change = old[id] ? 100 * (new[id] - old[id]) / old[id] : 0
+        if (d == 0) bad = (new[id] != old[id])
+        else bad = (d * change < -tolerance)
+        printf("%-38s %14.2f %14.2f %+8.1f%%  %s\n", id, old[id], new[id], change, bad ? (d ? "WORSE" : "CHANGED") : "ok")
+        worse += bad
+    }
+    if (worse) printf("%d number(s) worse than or different from the baseline\n", worse)
+    exit(worse ? 1 : 0)
+}
+' "$1" "$2"
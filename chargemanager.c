@@ -3,16 +3,32 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <limits.h>
+#include <ctype.h>
 #if !defined(__MACH__)
 #include <malloc.h>
 #endif
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <time.h>
 #include <libgen.h>
 #include <regex.h>
 #include <signal.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <poll.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
 #include <mosquitto.h>
 
 #define INTERVAL_DEFAULT  300
@@ -24,10 +40,435 @@
 #define HYSTERESIS_MAX_DEFAULT    95
 #define RUNTIME_DEFAULT           8
 #define TARGET_SOC_DEFAULT        80
+#define TICK_DEFAULT              1000
+#define TICK_SETTLE_MS            100
+#define GRID_SETPOINT_DEFAULT     100
+#define GRID_DEADBAND_DEFAULT     200
+#define GRID_INTEGRAL_TIME        60
+#define MIN_INTERVAL_DEFAULT      60
+
+#define CONTROL_SURPLUS           0
+#define CONTROL_GRID              1
+
+#define SERIES_SIZE               64
+#define WINDOW_DEFAULT            5
+
+#define SMOOTHING_NONE            0
+#define SMOOTHING_EWMA            1
+#define SMOOTHING_MEAN            2
+#define SMOOTHING_MEDIAN          3
+#define STALE_TIMEOUT_DEFAULT     60
+#define KEEPALIVE                 60
+#define RING_SIZE                 256
+
+#define STATS_INTERVAL            60
+#define STATS_LEN                 4096
+#define METRICS_TIMEOUT_MS        200
+#define HIST_BUCKETS              12
+
+#define RECORD_MAGIC              "CMREC02\n"
+#define RECORD_MAGIC_V1           "CMREC01\n"
+#define RECORD_FIELDS_V1          13
+#define RECORD_PAYLOAD_MAX        4096
+
+#define STATE_MAGIC               "CMSTA03"
+#define STATE_FILE_DEFAULT        "chargemanager.state"
+#define STATE_MAX_AGE             900
+
+#define FORECAST_MAX              120
+#define FORECAST_SLOTS            96
+#define FORECAST_TREND            16
+#define FORECAST_STEP             5
+#define FORECAST_DAY_WEIGHT       0.3
+#define FORECAST_DAYS             7
+#define FORECAST_HELD_START       1
+#define FORECAST_HELD_STOP        2
+
+#define SHARED_MAGIC              "CMSHM01"
+#define SHARED_NAME_LEN           64
+
+#define COMMAND_QUEUE_SIZE        16
+#define COMMAND_PAYLOAD_LEN       16
+#define COMMAND_FLUSH_TIMEOUT     3
+
+#define PENDING_SIZE              8
+#define CONFIRM_TIMEOUT           60
+#define CONFIRM_RETRIES           3
+
+#define TOPIC_HASH_SIZE           128
+#define VEHICLES_MAX              4
+
+#define SAMPLES_MAX               8
+
+#define LOG_RING_SIZE             1024
+#define LOG_LINE_LEN              240
+#define LOG_PRODUCERS             3
+#define LOG_FLUSH_MS              100
+#define LOG_SIZE_DEFAULT          10
+#define STATUS_WIDTH              96
+#define STATUS_INTERVAL_MS        1000
+
+#define BENCH_NONE                0
+#define BENCH_DECISION            1
+#define BENCH_E2E                 2
+#define BENCH_SECONDS             1024
+#define BENCH_MESSAGES_DEFAULT    1000000
+#define BENCH_ROUNDS_DEFAULT      6
+#define BENCH_TIMEOUT             10
+#ifndef SOURCE_DEFAULT
+#define SOURCE_DEFAULT            "e3dc"
+#endif
+#ifndef VEHICLE_BACKEND_DEFAULT
+#define VEHICLE_BACKEND_DEFAULT   "weconnect"
+#endif
+
+#define JSON_PATH_LEN             64
+#define JSON_DEPTH                8
+
+enum {
+    LOG_ERROR = 0,
+    LOG_INFO,
+    LOG_DEBUG,
+    LOG_STATUS
+};
+
+enum {
+    FIELD_NONE = 0,
+    FIELD_SOLAR_POWER,
+    FIELD_HOME_POWER,
+    FIELD_GRID_POWER,
+    FIELD_BATTERY_POWER,
+    FIELD_BATTERY_SOC,
+    FIELD_CHARGING_STATE,
+    FIELD_CURRENT_SOC,
+    FIELD_TARGET_SOC,
+    FIELD_RANGE,
+    FIELD_MAX_CHARGE_CURRENT,
+    FIELD_PLUG_CONNECTION,
+    FIELD_ODOMETER,
+    FIELD_SNAPSHOT,
+    FIELD_COUNT
+};
+
+// WeConnect states as enums, the last entry stands for every unknown name
+enum {
+    STATE_UNKNOWN = 0,
+    STATE_OFF,
+    STATE_READY_FOR_CHARGING,
+    STATE_NOT_READY_FOR_CHARGING,
+    STATE_CONSERVATION,
+    STATE_CHARGE_PURPOSE_REACHED,
+    STATE_CHARGE_PURPOSE_REACHED_CONSERVATION,
+    STATE_CHARGING,
+    STATE_ERROR,
+    STATE_DISCHARGING,
+    STATE_OTHER,
+    STATE_COUNT
+};
+
+enum {
+    CURRENT_UNKNOWN = 0,
+    CURRENT_MAXIMUM,
+    CURRENT_REDUCED,
+    CURRENT_OTHER,
+    CURRENT_COUNT
+};
+
+enum {
+    PLUG_UNKNOWN = 0,
+    PLUG_CONNECTED,
+    PLUG_DISCONNECTED,
+    PLUG_OTHER,
+    PLUG_COUNT
+};
+
+const char *state_name[STATE_COUNT] = {"", "off", "readyForCharging", "notReadyForCharging", "conservation",
+    "chargePurposeReachedAndNotConservationCharging", "chargePurposeReachedAndConservation", "charging", "error", "discharging", "other"};
+const char *current_name[CURRENT_COUNT] = {"", "maximum", "reduced", "other"};
+const char *plug_name[PLUG_COUNT] = {"", "connected", "disconnected", "other"};
+
+// keys of the site values in the JSON snapshot, nested objects are joined with '/'
+const char *snapshot_key[FIELD_CHARGING_STATE] = {NULL, "solar/power", "home/power", "grid/power", "battery/power", "battery/soc"};
 
 char *localhost = "localhost";
-char *weconnect = "weconnect";
-int go = 1;
+// cleared by the signal handler and read by the control, network and benchmark threads
+atomic_int go = 1;
+volatile sig_atomic_t reload = 0;
+long long virtual_us = 0;
+
+typedef struct _command {
+    char *topic;
+    char payload[COMMAND_PAYLOAD_LEN];
+    char *data;
+    int retain;
+    int mid;
+    long long queued_us;
+} command;
+
+// value is the number or the enum of the field
+typedef struct _sample {
+    int vehicle;
+    int field;
+    int value;
+    long long ts_us;
+} sample;
+
+// Single producer single consumer ring, the producer only writes tail and the consumer only head.
+typedef struct _ring {
+    atomic_uint head;
+    atomic_uint tail;
+    unsigned int size;
+    size_t elem;
+    char *buf;
+} ring;
+
+typedef struct _log_line {
+    int level;
+    char text[LOG_LINE_LEN];
+} log_line;
+
+// Lines are formatted by the calling thread and written by a background thread. Every producing
+// thread has its own ring, so the rings stay single producer. The writer sleeps on wake until the
+// first line of a batch is pending.
+typedef struct _logger {
+    ring lines[LOG_PRODUCERS];
+    int level;
+    FILE *out;
+    char *file;
+    long size;
+    long size_max;
+    int tty;
+    int status;
+    atomic_int running;
+    atomic_long dropped;
+    atomic_int pending;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+} logger;
+
+logger logs;
+// ring of the calling thread: 0 control, 1 network, 2 benchmark
+_Thread_local int log_producer = 0;
+
+// The last SERIES_SIZE values of a power input, fixed size so memory does not grow.
+typedef struct _series {
+    int v[SERIES_SIZE];
+    int pos;
+    int len;
+    double ewma;
+} series;
+
+#define POWER_SERIES (FIELD_BATTERY_POWER - FIELD_SOLAR_POWER + 1)
+
+// History of the surplus solar - home power: a profile of the day in slots of 15 minutes, averaged
+// over the previous days, and the means of the last FORECAST_TREND minutes for the trend.
+typedef struct _forecast {
+    int minutes;
+    double profile[FORECAST_SLOTS];
+    int days[FORECAST_SLOTS];
+    int slot;
+    double slot_sum;
+    long slot_n;
+    long minute;
+    double minute_sum;
+    long minute_n;
+    double trend[FORECAST_TREND];
+    int trend_pos;
+    int trend_len;
+    int ready;
+    int delta_min;
+    int delta_mean;
+    long held_starts;
+    long held_stops;
+} forecast;
+
+// A control command waiting for WeConnect to report the requested state.
+typedef struct _pending {
+    char *topic;
+    char payload[COMMAND_PAYLOAD_LEN];
+    int active;
+    int failed;
+    int retries;
+    int timeout;
+    long long first_us;
+    long long deadline_us;
+} pending;
+
+// Counts per bucket, the last bucket has no upper bound.
+typedef struct _histogram {
+    const double *bounds;
+    long counts[HIST_BUCKETS];
+    long count;
+    double sum;
+} histogram;
+
+const double decision_bounds[HIST_BUCKETS - 1] = {0.001, 0.005, 0.01, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+const double confirm_bounds[HIST_BUCKETS - 1] = {5, 10, 20, 30, 45, 60, 90, 120, 180, 300, 600};
+
+const char *field_name[FIELD_COUNT] = {"none", "solar_power", "home_power", "grid_power", "battery_power", "battery_soc",
+    "charging_state", "current_soc", "target_soc", "range", "max_charge_current", "plug_connection", "odometer", "snapshot"};
+
+enum {
+    COMMAND_START = 0,
+    COMMAND_STOP,
+    COMMAND_MAXIMUM,
+    COMMAND_REDUCED,
+    COMMAND_OTHER,
+    COMMAND_TYPES
+};
+
+const char *command_name[COMMAND_TYPES] = {"start", "stop", "maximum", "reduced", "other"};
+
+enum {
+    WRITE_CHARGING = 0,
+    WRITE_CURRENT,
+    WRITE_TARGET_SOC,
+    WRITE_UPDATE_INTERVAL,
+    WRITE_TOPICS
+};
+
+// Reads the value of a field from a payload that is not terminated, returns 0 if there is none.
+typedef int (*decode_fn)(const char *p, int len, int *value);
+
+// Adapter of an energy source or a vehicle bridge. The topics are formats of the prefix and, for a
+// vehicle, of the VIN. Fields without topic are not subscribed, commands without topic not sent,
+// the payloads replace the command names.
+typedef struct _backend {
+    const char *name;
+    const char *prefix;
+    const char *topic[FIELD_COUNT];
+    decode_fn decode[FIELD_COUNT];
+    const char *write[WRITE_TOPICS];
+    const char *payload[COMMAND_OTHER];
+} backend;
+
+// decoder of each field, taken from the selected backends at startup
+decode_fn field_decode[FIELD_COUNT];
+
+// topic ids combine the vehicle and the field, the e3dc fields belong to vehicle 0
+#define TOPIC_ID(vehicle, field)  ((vehicle) * FIELD_COUNT + (field))
+#define TOPIC_COUNT               (VEHICLES_MAX * FIELD_COUNT)
+#define SITE_FIELD(field)         (((field) < FIELD_CHARGING_STATE) || ((field) == FIELD_SNAPSHOT))
+
+#define ALLOCATION_PRIORITY       0
+#define ALLOCATION_SOC            1
+#define ALLOCATION_FAIR           2
+
+// State and topics of one car.
+typedef struct _vehicle {
+    char vin[18];
+    int chargingState;
+    int currentSOC_pct;
+    int targetSOC_pct;
+    int cruisingRangeElectric_km;
+    int maxChargeCurrentAC;
+    int km;
+    int connected;
+    int active;
+    int action;
+    time_t ts_last;
+    int share;
+    int grid_output;
+    double grid_integral;
+    long long grid_ts_us;
+    int held;
+    time_t held_s;
+    time_t held_seen_s;
+    long cycles;
+    char command[COMMAND_PAYLOAD_LEN];
+    long long command_us;
+    char *topic_control_charging;
+    char *topic_control_current;
+    char *topic_control_target_soc;
+    char label[24];
+} vehicle;
+
+// Part of the state file for one car.
+typedef struct _vehicle_state {
+    char vin[18];
+    int chargingState;
+    int maxChargeCurrentAC;
+    int currentSOC_pct;
+    int targetSOC_pct;
+    int cruisingRangeElectric_km;
+    int km;
+    int connected;
+    long long ts_last_us;
+    double grid_integral;
+} vehicle_state;
+
+// Layout of the memory mapped state file, written by the main thread once per tick.
+typedef struct _saved_state {
+    char magic[8];
+    int size;
+    long long saved_us;
+    int pv_solar_power;
+    int pv_home_power;
+    int pv_grid_power;
+    int pv_battery_power;
+    int pv_battery_soc;
+    int pump;
+    int vehicles;
+    vehicle_state car[VEHICLES_MAX];
+    double profile[FORECAST_SLOTS];
+    int days[FORECAST_SLOTS];
+} saved_state;
+
+// One car in the shared memory export.
+typedef struct _shared_vehicle {
+    char vin[18];
+    int active;
+    int connected;
+    int current_soc;
+    int target_soc;
+    int range_km;
+    char charging_state[48];
+    char charge_current[16];
+    int share;
+    int grid_output;
+    char command[COMMAND_PAYLOAD_LEN];
+    long long command_us;
+} shared_vehicle;
+
+// Read-only view for local dashboards in POSIX shared memory. seq is odd while the main thread
+// writes, a reader copies the struct and retries if seq was odd or has changed meanwhile.
+// Times are in us since the epoch.
+typedef struct _shared_state {
+    char magic[8];
+    int size;
+    atomic_uint seq;
+    int running;
+    int pid;
+    int session;
+    long long updated_us;
+    long long decision_us;
+    long evaluations;
+    int solar_power;
+    int home_power;
+    int grid_power;
+    int battery_power;
+    int battery_soc;
+    int surplus;
+    int pump;
+    int hysteresis_min;
+    int hysteresis_max;
+    int target_soc;
+    int control;
+    int vehicles;
+    shared_vehicle car[VEHICLES_MAX];
+} shared_state;
+
+// Synthetic publisher and observer of the end-to-end benchmark.
+typedef struct _bench {
+    struct _mqttattr *mqtta;
+    struct mosquitto *mosq;
+    pthread_t thread;
+    int rounds;
+    int received;
+    atomic_llong command_us;
+    double latency_ms[64];
+} bench;
 
 typedef struct _mqttattr {
     char *mqtt_host;
@@ -42,34 +483,126 @@ typedef struct _mqttattr {
     char **topics;
     int mode;
     char *prefix;
-    char vin[18];
+    char *source_prefix;
+    const backend *source;
+    const backend *api;
+    vehicle car[VEHICLES_MAX];
+    int vehicles;
+    char *config_file;
+    int argc;
+    char **argv;
+    int allocation;
+    int target_soc;
+    int daemon;
+    int session;
+    char *snapshot;
+    char *session_prefix;
+    FILE *session_log;
+    long long status_next_us;
+    saved_state *saved;
+    shared_state *shared;
+    char shared_name[SHARED_NAME_LEN];
+    long long decision_us;
     int reduced;
     int hysteresis_min;
     int hysteresis_max;
     int battery_max;
     int battery;
-    char chargingState[20];
-    int currentSOC_pct;
-    int targetSOC_pct;
-    int cruisingRangeElectric_km;
-    char maxChargeCurrentAC[20];
     int pv_solar_power;
     int pv_home_power;
     int pv_grid_power;
     int pv_battery_power;
     int pv_battery_soc;
-    int km;
+    series power[POWER_SERIES];
+    int smoothing;
+    int window;
+    forecast forecast;
     int pump;
-    int connected;
     int runtime;
-    char *topic_control_charging;
-    char *topic_control_current;
+    int tick_ms;
+    int dirty;
+    int power_available;
+    int control;
+    int grid_setpoint;
+    int grid_deadband;
+    int min_interval;
+    long evaluations;
+    time_t ts_start;
     char *topic_control_update_interval;
-    char *topic_control_target_soc;
+    char *topic_name[TOPIC_COUNT];
+    int topic_hash[TOPIC_HASH_SIZE];
+    long long field_seen_us[TOPIC_COUNT];
+    long long solar_arrival_us;
+    int field_timeout[TOPIC_COUNT];
+    int stale_timeout;
+    struct mosquitto *mosq;
+    FILE *record;
+    int replay;
+    long replay_commands;
+    int threaded;
+    ring rx;
+    ring tx;
+    int rx_fd;
+    int tx_fd;
+    atomic_long rx_dropped;
+    int online;
+    command cmdq[COMMAND_QUEUE_SIZE];
+    int cmdq_head;
+    int cmdq_len;
+    pending pending[PENDING_SIZE];
+    long confirm_count;
+    long confirm_failures;
+    long commands_suppressed;
+    long long confirm_latency_sum_us;
+    long long confirm_latency_max_us;
+    atomic_long publish_count;
+    atomic_long publish_errors;
+    atomic_long connects;
+    long field_count[FIELD_COUNT];
+    long command_count[COMMAND_TYPES];
+    histogram hist_decision;
+    histogram hist_confirm;
+    int stale_check;
+    char *topic_stats;
+    int metrics_port;
+    long long publish_latency_sum_us;
+    long long publish_latency_max_us;
 } mqttattr;
 
+vehicle create_vehicle() {
+    vehicle v;
+
+    strcpy(v.vin, "");
+    v.chargingState = STATE_UNKNOWN;
+    v.currentSOC_pct = -1;
+    v.targetSOC_pct = -1;
+    v.cruisingRangeElectric_km = -1;
+    v.maxChargeCurrentAC = CURRENT_UNKNOWN;
+    v.km = -1;
+    v.connected = 0;
+    v.active = 1;
+    v.action = 0;
+    v.ts_last = 0;
+    v.share = 0;
+    v.grid_output = 0;
+    v.grid_integral = 0;
+    v.grid_ts_us = 0;
+    v.held = 0;
+    v.held_s = 0;
+    v.held_seen_s = 0;
+    v.cycles = 0;
+    strcpy(v.command, "");
+    v.command_us = 0;
+    v.topic_control_charging = NULL;
+    v.topic_control_current = NULL;
+    v.topic_control_target_soc = NULL;
+    strcpy(v.label, "");
+    return(v);
+}
+
 mqttattr create_mqttattr() {
     mqttattr c;
+    int i;
 
     c.mqtt_host = NULL;
     c.mqtt_port = 1883;
@@ -81,30 +614,92 @@ mqttattr create_mqttattr() {
     c.tlen = 0;
     c.topics = NULL;
     c.prefix = NULL;
-    strcpy(c.vin, "");
+    c.source_prefix = NULL;
+    c.source = NULL;
+    c.api = NULL;
+    for (i = 0; i < VEHICLES_MAX; i++) c.car[i] = create_vehicle();
+    c.vehicles = 0;
+    c.config_file = NULL;
+    c.argc = 0;
+    c.argv = NULL;
+    c.allocation = ALLOCATION_PRIORITY;
+    c.target_soc = TARGET_SOC_DEFAULT;
+    c.daemon = 0;
+    c.session = 1;
+    c.snapshot = NULL;
+    c.session_prefix = NULL;
+    c.session_log = NULL;
+    c.status_next_us = 0;
+    c.saved = NULL;
+    c.shared = NULL;
+    strcpy(c.shared_name, "");
+    c.decision_us = 0;
     c.reduced = 0;
     c.hysteresis_min = HYSTERESIS_MIN_DEFAULT;
     c.hysteresis_max = HYSTERESIS_MAX_DEFAULT;
     c.battery_max = BATTERY_MAX_POWER_DEFAULT;
     c.battery = 0;
-    c.currentSOC_pct = -1;
-    c.targetSOC_pct = -1;
-    strcpy(c.chargingState, "");
-    c.cruisingRangeElectric_km = -1;
-    strcpy(c.maxChargeCurrentAC, "");
     c.pv_solar_power = -1;
     c.pv_home_power = 0;
     c.pv_grid_power = 0;
     c.pv_battery_power = 0;
     c.pv_battery_soc = TARGET_SOC_DEFAULT;
-    c.km = -1;
+    memset(c.power, 0, sizeof(c.power));
+    c.smoothing = SMOOTHING_MEDIAN;
+    c.window = WINDOW_DEFAULT;
+    memset(&c.forecast, 0, sizeof(c.forecast));
+    c.forecast.slot = -1;
     c.pump = 0;
-    c.connected = 0;
     c.runtime = RUNTIME_DEFAULT;
-    c.topic_control_charging = NULL;
-    c.topic_control_current = NULL;
+    c.tick_ms = TICK_DEFAULT;
+    c.dirty = 0;
+    c.power_available = 0;
+    c.control = CONTROL_SURPLUS;
+    c.grid_setpoint = GRID_SETPOINT_DEFAULT;
+    c.grid_deadband = GRID_DEADBAND_DEFAULT;
+    c.min_interval = MIN_INTERVAL_DEFAULT;
+    c.evaluations = 0;
+    c.ts_start = 0;
     c.topic_control_update_interval = NULL;
-    c.topic_control_target_soc = NULL;
+    memset(c.topic_name, 0, sizeof(c.topic_name));
+    memset(c.topic_hash, 0, sizeof(c.topic_hash));
+    memset(c.field_seen_us, 0, sizeof(c.field_seen_us));
+    c.solar_arrival_us = 0;
+    memset(c.field_timeout, 0, sizeof(c.field_timeout));
+    c.stale_timeout = STALE_TIMEOUT_DEFAULT;
+    c.mosq = NULL;
+    c.record = NULL;
+    c.replay = 0;
+    c.replay_commands = 0;
+    c.threaded = 0;
+    memset(&c.rx, 0, sizeof(c.rx));
+    memset(&c.tx, 0, sizeof(c.tx));
+    c.rx_fd = -1;
+    c.tx_fd = -1;
+    atomic_init(&c.rx_dropped, 0);
+    c.online = 0;
+    c.cmdq_head = 0;
+    c.cmdq_len = 0;
+    memset(c.pending, 0, sizeof(c.pending));
+    c.confirm_count = 0;
+    c.confirm_failures = 0;
+    c.commands_suppressed = 0;
+    c.confirm_latency_sum_us = 0;
+    c.confirm_latency_max_us = 0;
+    atomic_init(&c.publish_count, 0);
+    atomic_init(&c.publish_errors, 0);
+    atomic_init(&c.connects, 0);
+    memset(c.field_count, 0, sizeof(c.field_count));
+    memset(c.command_count, 0, sizeof(c.command_count));
+    memset(&c.hist_decision, 0, sizeof(c.hist_decision));
+    c.hist_decision.bounds = decision_bounds;
+    memset(&c.hist_confirm, 0, sizeof(c.hist_confirm));
+    c.hist_confirm.bounds = confirm_bounds;
+    c.stale_check = 0;
+    c.topic_stats = NULL;
+    c.metrics_port = 0;
+    c.publish_latency_sum_us = 0;
+    c.publish_latency_max_us = 0;
     return(c);
 }
 
@@ -141,6 +736,114 @@ int mstrcpy(char **str, const char *fmt, ...){
     return(i);
 }
 
+// Blocks SIGINT and SIGHUP in the calling thread and in the threads it creates until the old mask
+// is restored. Signals are handled by the control thread, so they interrupt its epoll_wait.
+void block_signals(sigset_t *old) {
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &set, old);
+    return;
+}
+
+int ring_init(ring *r, unsigned int size, size_t elem) {
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    r->size = size;
+    r->elem = elem;
+    r->buf = malloc(size * elem);
+    return(r->buf != NULL);
+}
+
+void ring_free(ring *r) {
+    if (r->buf) free(r->buf);
+    r->buf = NULL;
+    return;
+}
+
+// size must be a power of two
+int ring_push(ring *r, const void *e) {
+    unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+    if (tail - head == r->size) return(0);
+    memcpy(r->buf + (tail & (r->size - 1)) * r->elem, e, r->elem);
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    return(1);
+}
+
+int ring_pop(ring *r, void *e) {
+    unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+    if (head == tail) return(0);
+    memcpy(e, r->buf + (head & (r->size - 1)) * r->elem, r->elem);
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    return(1);
+}
+
+void series_add(series *sr, int value, int window) {
+    double alpha = 2.0 / (window + 1);
+
+    sr->ewma = sr->len ? sr->ewma + alpha * (value - sr->ewma) : value;
+    sr->v[sr->pos] = value;
+    sr->pos = (sr->pos + 1) % SERIES_SIZE;
+    if (sr->len < SERIES_SIZE) sr->len++;
+    return;
+}
+
+// copies the last n values (newest first) and returns how many there are
+int series_last(series *sr, int *out, int n) {
+    int i;
+
+    if (n > sr->len) n = sr->len;
+    for (i = 0; i < n; i++) out[i] = sr->v[(sr->pos - 1 - i + SERIES_SIZE) % SERIES_SIZE];
+    return(n);
+}
+
+int series_mean(series *sr, int window) {
+    int v[SERIES_SIZE];
+    int n = series_last(sr, v, window);
+    long sum = 0;
+    int i;
+
+    for (i = 0; i < n; i++) sum += v[i];
+    return(n ? sum / n : 0);
+}
+
+int series_median(series *sr, int window) {
+    int v[SERIES_SIZE];
+    int n = series_last(sr, v, window);
+    int i, j, x;
+
+    for (i = 1; i < n; i++) {
+        x = v[i];
+        for (j = i; (j > 0) && (v[j - 1] > x); j--) v[j] = v[j - 1];
+        v[j] = x;
+    }
+    if (!n) return(0);
+    return((n % 2) ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2);
+}
+
+// The value of a power input the control decides on.
+int smoothed(mqttattr *mqtta, int field) {
+    series *sr = &mqtta->power[field - FIELD_SOLAR_POWER];
+
+    if (!sr->len) return(0);
+    switch (mqtta->smoothing) {
+    case SMOOTHING_EWMA:
+        return((int)sr->ewma);
+    case SMOOTHING_MEAN:
+        return(series_mean(sr, mqtta->window));
+    case SMOOTHING_MEDIAN:
+        return(series_median(sr, mqtta->window));
+    default:
+        return(sr->v[(sr->pos - 1 + SERIES_SIZE) % SERIES_SIZE]);
+    }
+}
+
 int add_topic(mqttattr *mqtta, char *topic) {
     if (mosquitto_sub_topic_check(topic) == MOSQ_ERR_SUCCESS) {
         char **p;
@@ -155,265 +858,2675 @@ int add_topic(mqttattr *mqtta, char *topic) {
     return(0);
 }
 
+unsigned int topic_hash(const char *topic) {
+    unsigned int h = 2166136261u;
+
+    while (*topic) h = (h ^ (unsigned char)*topic++) * 16777619u;
+    return(h);
+}
+
+// Builds the exact topic of every consumed field once and subscribes to just these topics.
+// Creates the topics of the fields from the tables of the selected backends.
+int add_field_topics(mqttattr *mqtta) {
+    char **t = mqtta->topic_name;
+    int i, f, id;
+    unsigned int h;
+
+    for (f = FIELD_NONE + 1; f < FIELD_CHARGING_STATE; f++)
+        if (mqtta->source->topic[f] && !mstrcpy(&t[f], mqtta->source->topic[f], mqtta->source_prefix)) return(0);
+    if (mqtta->snapshot && !mstrcpy(&t[FIELD_SNAPSHOT], "%s", mqtta->snapshot)) return(0);
+    for (i = 0; i < mqtta->vehicles; i++) {
+        for (f = FIELD_CHARGING_STATE; f < FIELD_SNAPSHOT; f++)
+            if (mqtta->api->topic[f] && !mstrcpy(&t[TOPIC_ID(i, f)], mqtta->api->topic[f], mqtta->prefix, mqtta->car[i].vin)) return(0);
+    }
+
+    memset(mqtta->topic_hash, 0, sizeof(mqtta->topic_hash));
+    for (id = FIELD_NONE + 1; id < TOPIC_ID(mqtta->vehicles, 0); id++) {
+        if ((id >= FIELD_COUNT) && SITE_FIELD(id % FIELD_COUNT)) continue;
+        // the snapshot replaces the topics of the site values
+        if ((id == FIELD_SNAPSHOT) && !mqtta->snapshot) continue;
+        if ((id < FIELD_CHARGING_STATE) && mqtta->snapshot) continue;
+        if (!t[id]) continue;
+        if (!add_topic(mqtta, t[id])) return(0);
+        h = topic_hash(t[id]) % TOPIC_HASH_SIZE;
+        while (mqtta->topic_hash[h]) h = (h + 1) % TOPIC_HASH_SIZE;
+        mqtta->topic_hash[h] = id;
+    }
+    return(1);
+}
+
+// Returns the topic id, FIELD_NONE for unknown topics.
+int topic_lookup(mqttattr *mqtta, const char *topic) {
+    unsigned int h = topic_hash(topic) % TOPIC_HASH_SIZE;
+
+    while (mqtta->topic_hash[h]) {
+        if (!strcmp(mqtta->topic_name[mqtta->topic_hash[h]], topic)) return(mqtta->topic_hash[h]);
+        h = (h + 1) % TOPIC_HASH_SIZE;
+    }
+    return(FIELD_NONE);
+}
+
+// Reads a decimal number from a payload that is not terminated, a fraction is cut off.
+int parse_int(const char *p, int len, int *value) {
+    const char *end = p + len;
+    long long v = 0;
+    int sign = 1, digits = 0;
+
+    while ((p < end) && isspace((unsigned char)*p)) p++;
+    if ((p < end) && ((*p == '-') || (*p == '+'))) {
+        if (*p == '-') sign = -1;
+        p++;
+    }
+    for (; (p < end) && (*p >= '0') && (*p <= '9'); p++, digits++)
+        if (v <= INT_MAX) v = v * 10 + (*p - '0');
+    if (!digits) return(0);
+    if (v > INT_MAX) v = INT_MAX;
+    *value = sign * (int)v;
+    return(1);
+}
+
+// Maps a payload to the index of its name, unknown names to the last index.
+int parse_name(const char **names, int count, const char *p, int len) {
+    int i;
+
+    for (i = 1; i < count - 1; i++)
+        if (((int)strlen(names[i]) == len) && !memcmp(names[i], p, len)) return(i);
+    return(count - 1);
+}
+
+int decode_negated(const char *p, int len, int *value) {
+    if (!parse_int(p, len, value)) return(0);
+    *value = -*value;
+    return(1);
+}
+
+int decode_state(const char *p, int len, int *value) {
+    if (len <= 0) return(0);
+    *value = parse_name(state_name, STATE_COUNT, p, len);
+    return(1);
+}
+
+int decode_current(const char *p, int len, int *value) {
+    if (len <= 0) return(0);
+    *value = parse_name(current_name, CURRENT_COUNT, p, len);
+    return(1);
+}
+
+int decode_plug(const char *p, int len, int *value) {
+    if (len <= 0) return(0);
+    *value = parse_name(plug_name, PLUG_COUNT, p, len);
+    return(1);
+}
+
+// Energy sources. rscp2mqtt publishes the E3/DC values, openWB 1.x counts the PV power negative.
+const backend source_backend[] = {
+    {
+        .name = "e3dc",
+        .prefix = "e3dc",
+        .topic = {[FIELD_SOLAR_POWER] = "%s/solar/power", [FIELD_HOME_POWER] = "%s/home/power", [FIELD_GRID_POWER] = "%s/grid/power",
+            [FIELD_BATTERY_POWER] = "%s/battery/power", [FIELD_BATTERY_SOC] = "%s/battery/soc"},
+        .decode = {[FIELD_SOLAR_POWER] = parse_int, [FIELD_HOME_POWER] = parse_int, [FIELD_GRID_POWER] = parse_int,
+            [FIELD_BATTERY_POWER] = parse_int, [FIELD_BATTERY_SOC] = parse_int}
+    },
+    {
+        .name = "openwb",
+        .prefix = "openWB",
+        .topic = {[FIELD_SOLAR_POWER] = "%s/pv/W", [FIELD_HOME_POWER] = "%s/global/WHouseConsumption", [FIELD_GRID_POWER] = "%s/evu/W",
+            [FIELD_BATTERY_POWER] = "%s/housebattery/W", [FIELD_BATTERY_SOC] = "%s/housebattery/%%Soc"},
+        .decode = {[FIELD_SOLAR_POWER] = decode_negated, [FIELD_HOME_POWER] = parse_int, [FIELD_GRID_POWER] = parse_int,
+            [FIELD_BATTERY_POWER] = parse_int, [FIELD_BATTERY_SOC] = parse_int}
+    }
+};
+
+// Vehicle bridges, WeConnect-mqtt for the cars of the Volkswagen Group.
+const backend vehicle_backend[] = {
+    {
+        .name = "weconnect",
+        .prefix = "weconnect",
+        .topic = {
+            [FIELD_CHARGING_STATE] = "%s/vehicles/%s/domains/charging/chargingStatus/chargingState",
+            [FIELD_CURRENT_SOC] = "%s/vehicles/%s/domains/charging/batteryStatus/currentSOC_pct",
+            [FIELD_TARGET_SOC] = "%s/vehicles/%s/domains/charging/chargingSettings/targetSOC_pct",
+            [FIELD_RANGE] = "%s/vehicles/%s/domains/charging/batteryStatus/cruisingRangeElectric_km",
+            [FIELD_MAX_CHARGE_CURRENT] = "%s/vehicles/%s/domains/charging/chargingSettings/maxChargeCurrentAC",
+            [FIELD_PLUG_CONNECTION] = "%s/vehicles/%s/domains/charging/plugStatus/plugConnectionState",
+            [FIELD_ODOMETER] = "%s/vehicles/%s/domains/measurements/odometerStatus/odometer"
+        },
+        .decode = {[FIELD_CHARGING_STATE] = decode_state, [FIELD_CURRENT_SOC] = parse_int, [FIELD_TARGET_SOC] = parse_int, [FIELD_RANGE] = parse_int,
+            [FIELD_MAX_CHARGE_CURRENT] = decode_current, [FIELD_PLUG_CONNECTION] = decode_plug, [FIELD_ODOMETER] = parse_int},
+        .write = {
+            [WRITE_CHARGING] = "%s/vehicles/%s/controls/charging_writetopic",
+            [WRITE_CURRENT] = "%s/vehicles/%s/domains/charging/chargingSettings/maxChargeCurrentAC_writetopic",
+            [WRITE_TARGET_SOC] = "%s/vehicles/%s/domains/charging/chargingSettings/targetSOC_pct_writetopic",
+            [WRITE_UPDATE_INTERVAL] = "%s/mqtt/weconnectUpdateInterval_s_writetopic"
+        },
+        .payload = {[COMMAND_START] = "start", [COMMAND_STOP] = "stop", [COMMAND_MAXIMUM] = "maximum", [COMMAND_REDUCED] = "reduced"}
+    }
+};
+
+const backend *find_backend(const backend *table, int count, const char *name) {
+    int i;
+
+    for (i = 0; i < count; i++)
+        if (!strcmp(table[i].name, name)) return(&table[i]);
+    return(NULL);
+}
+
+// Takes the decoder of every field from the backend that serves it.
+void select_decoders(mqttattr *mqtta) {
+    int f;
+
+    for (f = FIELD_NONE; f < FIELD_COUNT; f++)
+        field_decode[f] = SITE_FIELD(f) ? mqtta->source->decode[f] : mqtta->api->decode[f];
+    return;
+}
+
 void destroy_mqttattr(mqttattr *mqtta) {
+    int f;
+
     if (mqtta) {
         if (mqtta->topics) free(mqtta->topics);
+        mqtta->topics = NULL;
         mqtta->tlen = 0;
+        for (f = 0; f < TOPIC_COUNT; f++) {
+            if (mqtta->topic_name[f]) free(mqtta->topic_name[f]);
+            mqtta->topic_name[f] = NULL;
+        }
+        for (; mqtta->cmdq_len; mqtta->cmdq_len--, mqtta->cmdq_head = (mqtta->cmdq_head + 1) % COMMAND_QUEUE_SIZE)
+            if (mqtta->cmdq[mqtta->cmdq_head].data) free(mqtta->cmdq[mqtta->cmdq_head].data);
     }
     return;
 }
 
-char *now(char *ts) {
-    struct tm *timeinfo;
+long long wall_us() {
     struct timeval tv;
 
+    if (virtual_us) return(virtual_us);
     gettimeofday(&tv, NULL);
-    timeinfo = localtime(&tv.tv_sec);
+    return((long long)tv.tv_sec * 1000000 + tv.tv_usec);
+}
+
+char *now(char *ts) {
+    struct tm tm;
+    struct tm *timeinfo = &tm;
+    time_t t = wall_us() / 1000000;
+
+    localtime_r(&t, timeinfo);
     sprintf(ts, "%.4d%.2d%.2d%.2d%.2d%.2d", timeinfo->tm_year + 1900, timeinfo->tm_mon + 1, timeinfo->tm_mday, timeinfo->tm_hour, timeinfo->tm_min, timeinfo->tm_sec);
     return(ts);
 }
 
-int publish(char *cid, char *host, int port, char *topic, char *payload, int qos, int retain, int verbose, char *user, char *password){
-    int rc = 1;
-    struct mosquitto *mosq = NULL;
-    bool r = retain?true:false;
-    char timestamp[24];
+// monotonic clock for all intervals, during a replay the time of the recorded message
+long long now_us() {
+    struct timespec ts;
 
-    now(timestamp);
+    if (virtual_us) return(virtual_us);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
 
-    if (verbose) printf("[%s] publish: cid->%s< host->%s< port->%d< topic->%s< payload->%s< qos->%d< retain->%d<\n", timestamp, cid, host, port, topic, payload, qos, retain);
+time_t now_s() {
+    return(now_us() / 1000000);
+}
 
-    mosq = mosquitto_new(cid, true, NULL);
-    if (mosq) {
-        if (user && password) mosquitto_username_pw_set(mosq, user, password);
-        if (mosquitto_connect(mosq, host, port, 10)) {
-            if (verbose) printf("[%s] publish: Error mosquitto_connect failed.\n", timestamp);
-            mosquitto_destroy(mosq);
-            mosq = NULL;
-        } else  if (verbose) printf("[%s] publish: MQTT broker connected.\n", timestamp);
-    } else  if (verbose) printf("[%s] publish: Error mosquitto_new or mosquitto_connect failed.\n", timestamp);
-    if (mosq) {
-        rc = mosquitto_publish(mosq, NULL, topic, strlen(payload), payload, qos, r);
-        if (rc) {
-            if (verbose) printf("[%s] publish: Error >%s<\n", timestamp, mosquitto_strerror(rc));
-        } else  if (verbose) printf("[%s] publish: successfully done.\n", timestamp);
+// Writes one line, the status line is overwritten in place on a terminal.
+void log_write(log_line *l) {
+    int n;
+
+    if (l->level == LOG_STATUS) {
+        n = fprintf(logs.out, "\r%-*s", STATUS_WIDTH, l->text);
+        logs.status = 1;
+    } else {
+        n = fprintf(logs.out, "%s%s\n", logs.status ? "\n" : "", l->text);
+        logs.status = 0;
     }
-    mosquitto_disconnect(mosq);
-    mosquitto_destroy(mosq);
+    if (n > 0) logs.size += n;
+    return;
+}
 
-    return(rc);
+// Moves a full log file to <file>.1, an older one is overwritten.
+void log_rotate() {
+    char *old = NULL;
+
+    if (!logs.file || !logs.size_max || (logs.size < logs.size_max)) return;
+    fclose(logs.out);
+    if (mstrcpy(&old, "%s.1", logs.file)) {
+        rename(logs.file, old);
+        free(old);
+    }
+    logs.out = fopen(logs.file, "a");
+    if (!logs.out) logs.out = stdout;
+    logs.size = 0;
+    return;
 }
 
-static void catch_signal(int sig) {
-    printf("\nProgram stopped by user.");
-    go = 0;
+void log_drain() {
+    log_line l;
+    long dropped;
+    int i, n = 0;
+
+    for (i = 0; i < LOG_PRODUCERS; i++)
+        while (ring_pop(&logs.lines[i], &l)) {
+            log_write(&l);
+            n++;
+        }
+    dropped = atomic_exchange(&logs.dropped, 0);
+    if (dropped) {
+        l.level = LOG_ERROR;
+        snprintf(l.text, sizeof(l.text), "log: %ld lines dropped", dropped);
+        log_write(&l);
+        n++;
+    }
+    if (n) {
+        fflush(logs.out);
+        log_rotate();
+    }
+    return;
 }
 
-int regex_match(char *string, char *pattern) {
-    regex_t preg;
-    size_t nmatch = 1;
-    regmatch_t pmatch[nmatch];
+void *log_thread(void *arg) {
+    struct timespec ts;
 
-    if (regcomp(&preg, pattern, REG_EXTENDED | REG_NEWLINE))
-        return(0);
-    if (regexec(&preg, string, nmatch, pmatch, 0) == REG_NOMATCH) {
-        regfree(&preg);
-        return(0);
-    } else {
-        regfree(&preg);
-        return(1);
+    pthread_mutex_lock(&logs.lock);
+    while (atomic_load(&logs.running)) {
+        if (!atomic_load(&logs.pending)) {
+            pthread_cond_wait(&logs.wake, &logs.lock);
+            continue;
+        }
+        // collects the lines of a batch for LOG_FLUSH_MS, only log_stop() wakes the wait early
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 1000000L * LOG_FLUSH_MS;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&logs.wake, &logs.lock, &ts);
+        atomic_store(&logs.pending, 0);
+        pthread_mutex_unlock(&logs.lock);
+        log_drain();
+        pthread_mutex_lock(&logs.lock);
     }
+    pthread_mutex_unlock(&logs.lock);
+    log_drain();
+    return(NULL);
 }
 
-void connect_callback(struct mosquitto *mosq, void *obj, int result) {
+void log_msg(int level, const char *format, ...) {
     char timestamp[24];
+    log_line l;
+    va_list args;
+    int n = 0;
+
+    if ((level == LOG_STATUS) && !logs.tty) return;
+    if ((level != LOG_STATUS) && (level > logs.level)) return;
+
+    l.level = level;
+    if (level != LOG_STATUS) n = snprintf(l.text, sizeof(l.text), "[%s] ", now(timestamp));
+    va_start(args, format);
+    vsnprintf(l.text + n, sizeof(l.text) - n, format, args);
+    va_end(args);
+
+    // before the start, after the stop and during a replay the line is written directly
+    if (!atomic_load(&logs.running)) {
+        log_write(&l);
+        if (level != LOG_STATUS) fflush(logs.out);
+        log_rotate();
+        return;
+    }
+    if (!ring_push(&logs.lines[log_producer], &l)) logs.dropped++;
+    // only the first line of a batch wakes the writer
+    if (!atomic_exchange(&logs.pending, 1)) {
+        pthread_mutex_lock(&logs.lock);
+        pthread_cond_signal(&logs.wake);
+        pthread_mutex_unlock(&logs.lock);
+    }
+    return;
+}
 
-    now(timestamp);
-    mqttattr *mqtta = obj;
-
-    if (!result) {
-        mosquitto_subscribe_multiple(mosq, NULL, mqtta->tlen, (char *const *const)mqtta->topics, mqtta->qos, 0, NULL);
+// Starts the logger, without a thread the lines are written synchronously.
+int log_start(int level, char *file, int size_mb, int thread) {
+    sigset_t old;
+    int i, rc;
+
+    logs.level = level;
+    logs.out = stdout;
+    logs.file = file;
+    logs.size = 0;
+    logs.size_max = 1024L * 1024 * size_mb;
+    logs.status = 0;
+    atomic_init(&logs.running, 0);
+    atomic_init(&logs.dropped, 0);
+    if (file) {
+        logs.out = fopen(file, "a");
+        if (!logs.out) {
+            logs.out = stdout;
+            logs.file = NULL;
+            printf("Error: could not open log file '%s'\n", file);
+        } else logs.size = ftell(logs.out);
+    }
+    logs.tty = !logs.file && isatty(fileno(stdout));
+    if (!thread) return(1);
+
+    for (i = 0; i < LOG_PRODUCERS; i++)
+        if (!ring_init(&logs.lines[i], LOG_RING_SIZE, sizeof(log_line))) return(0);
+    atomic_init(&logs.pending, 0);
+    pthread_mutex_init(&logs.lock, NULL);
+    pthread_cond_init(&logs.wake, NULL);
+    atomic_store(&logs.running, 1);
+    block_signals(&old);
+    rc = pthread_create(&logs.thread, NULL, log_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc) {
+        atomic_store(&logs.running, 0);
+        return(0);
+    }
+    return(1);
+}
 
-        if (mqtta->verbose) {
-            printf("[%s] Source MQTT broker connected.\n", timestamp);
-            int i;
-            for (i = 0; i < mqtta->tlen; i++)
-                printf("[%s] topic '%s' subscribed.\n", timestamp, mqtta->topics[i]);
-        }
+void log_stop() {
+    int i;
+
+    if (atomic_load(&logs.running)) {
+        pthread_mutex_lock(&logs.lock);
+        atomic_store(&logs.running, 0);
+        pthread_cond_signal(&logs.wake);
+        pthread_mutex_unlock(&logs.lock);
+        pthread_join(logs.thread, NULL);
+        pthread_mutex_destroy(&logs.lock);
+        pthread_cond_destroy(&logs.wake);
+        for (i = 0; i < LOG_PRODUCERS; i++) ring_free(&logs.lines[i]);
     }
+    if (logs.status) fprintf(logs.out, "\n");
+    logs.status = 0;
+    if (logs.out != stdout) fclose(logs.out);
+    logs.out = stdout;
+    logs.file = NULL;
     return;
 }
 
-void message_callback(struct mosquitto *mosq, void *obj, const struct mosquitto_message *message) {
+// One CSV file per session with every sample, decision and command for a later analysis.
+// The file is buffered by stdio and written by the thread that runs the control.
+void session_close(mqttattr *mqtta) {
+    if (mqtta->session_log) fclose(mqtta->session_log);
+    mqtta->session_log = NULL;
+    return;
+}
+
+void session_open(mqttattr *mqtta) {
     char timestamp[24];
-    mqttattr *mqtta = obj;
-    int action = 0;
-    int power_available = 0;
-    static time_t ts_last = 0;
-    static time_t ts_start = 0;
+    char *file = NULL;
+
+    session_close(mqtta);
+    if (!mqtta->session_prefix || !mstrcpy(&file, "%s-%s.csv", mqtta->session_prefix, now(timestamp))) return;
+    mqtta->session_log = fopen(file, "w");
+    if (!mqtta->session_log) log_msg(LOG_ERROR, "Error: could not open session log '%s'", file);
+    else fprintf(mqtta->session_log, "time_us,event,vehicle,name,value,text\n");
+    free(file);
+    return;
+}
 
-    if (ts_start == 0) ts_start = time(NULL);
+// vehicle is -1 for the site values
+void session_event(mqttattr *mqtta, const char *event, int vehicle, const char *name, int value, const char *text) {
+    if (!mqtta->session_log) return;
+    if (vehicle < 0) fprintf(mqtta->session_log, "%lld,%s,,%s,%d,%s\n", wall_us(), event, name, value, text ? text : "");
+    else fprintf(mqtta->session_log, "%lld,%s,%d,%s,%d,%s\n", wall_us(), event, vehicle, name, value, text ? text : "");
+    return;
+}
 
-    now(timestamp);
+// Sends all queued commands over the persistent connection. Commands stay in the queue
+// until the broker has accepted them (publish callback), so they survive a reconnect.
+void flush_commands(mqttattr *mqtta) {
+    int i, rc;
 
-    if (mqtta->verbose) printf("[%s] >%s< >%.*s<\n", timestamp, message->topic, message->payloadlen, (char*)message->payload);
+    if (!mqtta->mosq || !mqtta->online) return;
 
-    if (!strcmp(message->topic, "e3dc/solar/power")) {
-        mqtta->pv_solar_power = atoi((char*)message->payload);
-        if (mqtta->pv_solar_power == 0) {
-            printf("\nStop program because solar power is 0.\n");
-            go = 0;
-        } else action = 1;
-    } else if (!strcmp(message->topic, "e3dc/home/power"))
-        mqtta->pv_home_power = atoi((char*)message->payload);
-    else if (!strcmp(message->topic, "e3dc/grid/power"))
-        mqtta->pv_grid_power = atoi((char*)message->payload);
-    else if (!strcmp(message->topic, "e3dc/battery/power"))
-        mqtta->pv_battery_power = atoi((char*)message->payload);
-    else if (!strcmp(message->topic, "e3dc/battery/soc"))
-        mqtta->pv_battery_soc = atoi((char*)message->payload);
-    else if (strstr(message->topic, mqtta->vin) && strstr(message->topic, "domains/charging/chargingStatus/chargingState")) {
-        if ((message->payloadlen > 0) && (message->payloadlen < 20)) {
-            strncpy(mqtta->chargingState, (char*)message->payload, message->payloadlen);
-            mqtta->chargingState[message->payloadlen] = 0;
-            action = 1;
-        }
-    } else if (strstr(message->topic, mqtta->vin) && strstr(message->topic, "domains/charging/batteryStatus/currentSOC_pct")) {
-        if (message->payloadlen > 0) mqtta->currentSOC_pct = atoi((char*)message->payload);
-    } else if (strstr(message->topic, mqtta->vin) && strstr(message->topic, "domains/charging/chargingSettings/targetSOC_pct")) {
-        if (message->payloadlen > 0) mqtta->targetSOC_pct = atoi((char*)message->payload);
-    } else if (strstr(message->topic, mqtta->vin) && strstr(message->topic, "domains/charging/batteryStatus/cruisingRangeElectric_km")) {
-        if (message->payloadlen > 0) mqtta->cruisingRangeElectric_km = atoi((char*)message->payload);
-    } else if (strstr(message->topic, mqtta->vin) && strstr(message->topic, "domains/charging/chargingSettings/maxChargeCurrentAC")) {
-        if ((message->payloadlen > 0) && (message->payloadlen < 20)) {
-            strncpy(mqtta->maxChargeCurrentAC, (char*)message->payload, message->payloadlen);
-            mqtta->maxChargeCurrentAC[message->payloadlen] = 0;
-        }
-    } else if (strstr(message->topic, mqtta->vin) && strstr(message->topic, "domains/charging/plugStatus/plugConnectionState")) {
-        if (!strncmp((char*)message->payload, "connected", message->payloadlen)) mqtta->connected = 1;
-        if ((!strncmp((char*)message->payload, "disconnected", message->payloadlen)) && mqtta->connected) {
-            printf("\nStop program because car has been disconnected.\n");
-            go = 0;
-        }
-    } else if (strstr(message->topic, mqtta->vin) && strstr(message->topic, "domains/measurements/odometerStatus/odometer")) {
-        if (mqtta->km < 0) {
-            mqtta->km = atoi((char*)message->payload);
-            printf("\nkm = %d\n", mqtta->km);
+    // the publish callback may remove entries while we are sending, so search from the start each time
+    for (i = 0; i < mqtta->cmdq_len; i++) {
+        command *cmd = &mqtta->cmdq[(mqtta->cmdq_head + i) % COMMAND_QUEUE_SIZE];
+        if (cmd->mid >= 0) continue;
+        i = -1;
+        char *payload = cmd->data ? cmd->data : cmd->payload;
+        rc = mosquitto_publish(mqtta->mosq, &cmd->mid, cmd->topic, strlen(payload), payload, mqtta->qos, (mqtta->retain || cmd->retain)?true:false);
+        if (rc) {
+            cmd->mid = -1;
+            mqtta->publish_errors++;
+            log_msg(LOG_ERROR, "publish: Error >%s<", mosquitto_strerror(rc));
+            return;
         }
-        if (mqtta->km && (atoi((char*)message->payload) > mqtta->km)) {
-            printf("\nStop program because car is moving (km = %d).\n", atoi((char*)message->payload));
-            go = 0;
+    }
+    return;
+}
+
+// Appends a command to the queue of the connection, drops the oldest one if the queue is full.
+// Newer statistics replace the queued ones, so an outage cannot push control commands out.
+void enqueue_command(mqttattr *mqtta, command *c) {
+    int i;
+
+    if (c->topic && (c->topic == mqtta->topic_stats)) {
+        for (i = 0; i < mqtta->cmdq_len; i++) {
+            command *q = &mqtta->cmdq[(mqtta->cmdq_head + i) % COMMAND_QUEUE_SIZE];
+            if ((q->topic != c->topic) || (q->mid >= 0)) continue;
+            if (q->data) free(q->data);
+            *q = *c;
+            q->mid = -1;
+            return;
         }
     }
 
-    if (time(NULL) > ts_start + (3600 * mqtta->runtime)) {
-        printf("\nStop program because runtime has expired.\n");
-        go = 0;
+    if (mqtta->cmdq_len == COMMAND_QUEUE_SIZE) {
+        log_msg(LOG_ERROR, "publish: Error command queue full, dropping >%s<", mqtta->cmdq[mqtta->cmdq_head].topic);
+        if (mqtta->cmdq[mqtta->cmdq_head].data) free(mqtta->cmdq[mqtta->cmdq_head].data);
+        mqtta->cmdq_head = (mqtta->cmdq_head + 1) % COMMAND_QUEUE_SIZE;
+        mqtta->cmdq_len--;
+        mqtta->publish_errors++;
     }
 
-    if (mqtta->pv_solar_power <= 0)
-        power_available = 0;
-    else if ((mqtta->pv_battery_soc >= mqtta->hysteresis_max) && (mqtta->pump == 0)) {
-        mqtta->pump = 1;
-        power_available = mqtta->pv_solar_power - mqtta->pv_home_power + mqtta->battery_max;
-    } else if ((mqtta->pv_battery_soc < mqtta->hysteresis_min) && (mqtta->pump == 1)) {
-        mqtta->pump = 0;
-        power_available = mqtta->pv_solar_power - mqtta->pv_home_power - mqtta->battery;
-    } else if (mqtta->pump == 1)
-        power_available = mqtta->pv_solar_power - mqtta->pv_home_power + mqtta->battery_max;
-    else
-        power_available = mqtta->pv_solar_power - mqtta->pv_home_power - mqtta->battery;
+    mqtta->cmdq[(mqtta->cmdq_head + mqtta->cmdq_len) % COMMAND_QUEUE_SIZE] = *c;
+    mqtta->cmdq[(mqtta->cmdq_head + mqtta->cmdq_len) % COMMAND_QUEUE_SIZE].mid = -1;
+    mqtta->cmdq_len++;
+    return;
+}
+
+// Hands a command to the queue of the connection, or to the network thread in threaded mode.
+int submit_command(mqttattr *mqtta, command *cmd) {
+    cmd->mid = -1;
+    cmd->queued_us = now_us();
+
+#if defined(__linux__)
+    // handed over to the network thread, which owns the queue and the connection once it runs
+    if (mqtta->threaded && mqtta->tx.buf) {
+        uint64_t one = 1;
+        if (!ring_push(&mqtta->tx, cmd)) {
+            log_msg(LOG_ERROR, "publish: Error outgoing ring full");
+            if (cmd->data) free(cmd->data);
+            return(1);
+        }
+        if (write(mqtta->tx_fd, &one, sizeof(one)) < 0) return(1);
+        return(0);
+    }
+#endif
 
-    printf("\r                                                                                                ");
-    printf("\r[%s] SOC=%d(%d) Range=%dkm surplus=%dW State: %s %s", timestamp, mqtta->currentSOC_pct, mqtta->targetSOC_pct, mqtta->cruisingRangeElectric_km, power_available, mqtta->chargingState, mqtta->maxChargeCurrentAC);
-    fflush(NULL);
+    enqueue_command(mqtta, cmd);
+    flush_commands(mqtta);
 
-    if (action && ((time(NULL) - ts_last) > INTERVAL_FAST)) {
-        ts_last = time(NULL);
+    return(0);
+}
 
-        // Power
-        if (mqtta->reduced && strcmp(mqtta->maxChargeCurrentAC, "reduced")) {
-            publish(mqtta->cid, mqtta->mqtt_host, mqtta->mqtt_port, mqtta->topic_control_current, (char*)"reduced", mqtta->qos, mqtta->retain, mqtta->verbose, mqtta->mqtt_user, mqtta->mqtt_password);
-            printf("\n[%s] published: switch to reduced charging power (reduced mode)\n", timestamp);
-        } else if (!mqtta->reduced && !strcmp(mqtta->chargingState, "charging") && (power_available > REDUCED_CHARGE_POWER)) {
-            if (strcmp(mqtta->maxChargeCurrentAC, "maximum")) {
-                publish(mqtta->cid, mqtta->mqtt_host, mqtta->mqtt_port, mqtta->topic_control_current, (char*)"maximum", mqtta->qos, mqtta->retain, mqtta->verbose, mqtta->mqtt_user, mqtta->mqtt_password);
-                printf("\n[%s] published: switch to maximum charging power\n", timestamp);
-            }
-        } else if (!mqtta->reduced && !strcmp(mqtta->chargingState, "charging") && (power_available < 0)) {
-            if (strcmp(mqtta->maxChargeCurrentAC, "reduced")) {
-                publish(mqtta->cid, mqtta->mqtt_host, mqtta->mqtt_port, mqtta->topic_control_current, (char*)"reduced", mqtta->qos, mqtta->retain, mqtta->verbose, mqtta->mqtt_user, mqtta->mqtt_password);
-                printf("\n[%s] published: switch to reduced charging power\n", timestamp);
-            }
-        }
+int publish(mqttattr *mqtta, char *topic, char *payload) {
+    command cmd;
+    int i, vehicle = -1;
 
-        // Charging
-        if ((!strcmp(mqtta->chargingState, "readyForCharging")) && (power_available > REDUCED_CHARGE_POWER)) {
-            publish(mqtta->cid, mqtta->mqtt_host, mqtta->mqtt_port, mqtta->topic_control_charging, (char*)"start", mqtta->qos, mqtta->retain, mqtta->verbose, mqtta->mqtt_user, mqtta->mqtt_password);
-            printf("\n[%s] published: start charging\n", timestamp);
-        } else if (!strcmp(mqtta->chargingState, "charging") && (power_available < -250) && (!strcmp(mqtta->maxChargeCurrentAC, "reduced"))) {
-            publish(mqtta->cid, mqtta->mqtt_host, mqtta->mqtt_port, mqtta->topic_control_charging, (char*)"stop", mqtta->qos, mqtta->retain, mqtta->verbose, mqtta->mqtt_user, mqtta->mqtt_password);
-            printf("\n[%s] published: stop charging\n", timestamp);
-        }
+    if (!topic) return(0);
+    log_msg(LOG_DEBUG, "publish: topic->%s< payload->%s< qos->%d< retain->%d<", topic, payload, mqtta->qos, mqtta->retain);
+
+    if (mqtta->session_log) {
+        for (i = 0; i < mqtta->vehicles; i++)
+            if ((topic == mqtta->car[i].topic_control_charging) || (topic == mqtta->car[i].topic_control_current) || (topic == mqtta->car[i].topic_control_target_soc)) vehicle = i;
+        session_event(mqtta, "command", vehicle, payload, 0, topic);
+    }
+
+    // a replay has no broker, the command is only reported
+    if (mqtta->replay) {
+        log_msg(LOG_INFO, "command %s %s", topic, payload);
+        mqtta->replay_commands++;
+        return(0);
     }
 
+    cmd.topic = topic;
+    snprintf(cmd.payload, COMMAND_PAYLOAD_LEN, "%s", payload);
+    cmd.data = NULL;
+    cmd.retain = 0;
+
+    return(submit_command(mqtta, &cmd));
+}
+
+void histogram_add(histogram *h, double v) {
+    int i;
+
+    for (i = 0; (i < HIST_BUCKETS - 1) && (v > h->bounds[i]); i++);
+    h->counts[i]++;
+    h->count++;
+    h->sum += v;
     return;
 }
 
-int main(int argc, char **argv) {
-    struct mosquitto *mosq;
-    int rc = 0;
-    int i = 0;
-    char buffer[16];
+int count_command(mqttattr *mqtta, char *payload) {
+    int i;
 
-    if (signal(SIGINT, catch_signal) == SIG_ERR) {
-        printf("error: signal couldn't be set.\n");
-        exit(0);
+    for (i = 0; (i < COMMAND_OTHER) && strcmp(payload, command_name[i]); i++);
+    mqtta->command_count[i]++;
+    return(i);
+}
+
+// Publishes a command name as the payload the vehicle backend expects for it.
+int publish_command(mqttattr *mqtta, char *topic, char *name) {
+    int i;
+
+    for (i = 0; (i < COMMAND_OTHER) && strcmp(name, command_name[i]); i++);
+    if ((i < COMMAND_OTHER) && mqtta->api->payload[i]) return(publish(mqtta, topic, (char*)mqtta->api->payload[i]));
+    return(publish(mqtta, topic, name));
+}
+
+pending *find_pending(mqttattr *mqtta, char *topic) {
+    pending *free_slot = NULL;
+    int i;
+
+    for (i = 0; i < PENDING_SIZE; i++) {
+        if (mqtta->pending[i].active && (mqtta->pending[i].topic == topic)) return(&mqtta->pending[i]);
+        if (!mqtta->pending[i].active && !free_slot) free_slot = &mqtta->pending[i];
     }
+    return(free_slot);
+}
 
-    mqttattr mqtta = create_mqttattr();
+// Publishes a control command unless the same command is still waiting for its confirmation,
+// returns 1 if it has been sent. The command name is published as the payload of the vehicle backend.
+int send_command(mqttattr *mqtta, char *topic, char *payload) {
+    pending *p = find_pending(mqtta, topic);
+    long long t = now_us();
+    int i;
 
-    while (i < argc) {
-        if ((!strcmp(argv[i], "--host")) && (i + 1 < argc)) mqtta.mqtt_host = argv[++i];
-        if ((!strcmp(argv[i], "--port")) && (i + 1 < argc)) mqtta.mqtt_port = atoi(argv[++i]);
-        if ((!strcmp(argv[i], "--user")) && (i + 1 < argc)) mqtta.mqtt_user = argv[++i];
-        if ((!strcmp(argv[i], "--password")) && (i + 1 < argc)) mqtta.mqtt_password = argv[++i];
-        if ((!strcmp(argv[i], "--qos")) && (i + 1 < argc)) mqtta.qos = atoi(argv[++i]);
-        if ((!strcmp(argv[i], "--retain")) && (i + 1 < argc)) mqtta.retain = atoi(argv[++i]);
-        if ((!strcmp(argv[i], "--vin")) && (i + 1 < argc)) strncpy(mqtta.vin, argv[++i], 18);
-        if ((!strcmp(argv[i], "--battery")) && (i + 1 < argc)) mqtta.battery = abs(atoi(argv[++i]));
-        if ((!strcmp(argv[i], "--battery_max")) && (i + 1 < argc)) mqtta.battery_max = abs(atoi(argv[++i]));
-        if (!strcmp(argv[i], "--no_hysteresis")) mqtta.pump = -1;
-        if ((!strcmp(argv[i], "--hysteresis_min")) && (i + 1 < argc)) mqtta.hysteresis_min = abs(atoi(argv[++i]));
-        if ((!strcmp(argv[i], "--hysteresis_max")) && (i + 1 < argc)) mqtta.hysteresis_max = abs(atoi(argv[++i]));
-        if ((!strcmp(argv[i], "--prefix")) && (i + 1 < argc)) mqtta.prefix = argv[++i];
-        if ((!strcmp(argv[i], "--target_soc")) && (i + 1 < argc)) mqtta.targetSOC_pct = abs(atoi(argv[++i]));
-        if (!strcmp(argv[i], "--reduced")) mqtta.reduced = 1;
-        if (!strcmp(argv[i], "-v")) mqtta.verbose = 1;
-        if (!strcmp(argv[i], "--runtime")) mqtta.runtime = abs(atoi(argv[++i]));
-        i++;
+    if (!topic) return(0);
+    if (p && p->active && !strcmp(p->payload, payload)) {
+        mqtta->commands_suppressed++;
+        return(0);
     }
 
-    if (!mqtta.mqtt_host) mqtta.mqtt_host = localhost;
-    if (!mqtta.prefix) mqtta.prefix = weconnect;
-    if ((mqtta.qos < 0) || (mqtta.qos > 2)) mqtta.qos = 0;
-    if ((mqtta.targetSOC_pct < 30) || (mqtta.targetSOC_pct > 100) || (mqtta.targetSOC_pct % 10)) mqtta.targetSOC_pct = TARGET_SOC_DEFAULT;
-    if ((mqtta.hysteresis_min < 0) || (mqtta.hysteresis_min > 100 )) mqtta.hysteresis_min = HYSTERESIS_MIN_DEFAULT;
-    if ((mqtta.hysteresis_max < 0) || (mqtta.hysteresis_max > 100 )) mqtta.hysteresis_max = HYSTERESIS_MAX_DEFAULT;
-    if (mqtta.hysteresis_min >= mqtta.hysteresis_max) {
-        mqtta.hysteresis_min = HYSTERESIS_MIN_DEFAULT;
-        mqtta.hysteresis_max = HYSTERESIS_MAX_DEFAULT;
+    // a different command for the same topic replaces the pending one
+    if (p) {
+        p->topic = topic;
+        snprintf(p->payload, COMMAND_PAYLOAD_LEN, "%s", payload);
+        p->active = 1;
+        p->failed = 0;
+        p->retries = 0;
+        p->timeout = CONFIRM_TIMEOUT;
+        p->first_us = t;
+        p->deadline_us = t + 1000000LL * p->timeout;
     }
-    if ((mqtta.runtime < 1) || (mqtta.runtime > 10)) mqtta.runtime = RUNTIME_DEFAULT;
+    count_command(mqtta, payload);
+    for (i = 0; i < mqtta->vehicles; i++) {
+        vehicle *v = &mqtta->car[i];
+        if ((topic != v->topic_control_charging) && (topic != v->topic_control_current)) continue;
+        snprintf(v->command, COMMAND_PAYLOAD_LEN, "%s", payload);
+        v->command_us = wall_us();
+    }
+    // latency from the arrival of the solar power to the decision, commands on stale data are none
+    if (mqtta->solar_arrival_us && !mqtta->stale_check)
+        histogram_add(&mqtta->hist_decision, (t - mqtta->solar_arrival_us) / 1e6);
+    publish_command(mqtta, topic, payload);
+    return(1);
+}
 
-    add_topic(&mqtta, "+/vehicles/+/domains/charging/#");
-    add_topic(&mqtta, "+/vehicles/+/domains/measurements/#");
-    add_topic(&mqtta, "e3dc/+/power");
-    add_topic(&mqtta, "e3dc/battery/soc");
+int command_confirmed(mqttattr *mqtta, pending *p) {
+    int i;
 
-    if (strlen(mqtta.vin) != 17) {
+    for (i = 0; i < mqtta->vehicles; i++) {
+        vehicle *v = &mqtta->car[i];
+        if (p->topic == v->topic_control_current)
+            return(v->maxChargeCurrentAC == parse_name(current_name, CURRENT_COUNT, p->payload, strlen(p->payload)));
+        if (p->topic == v->topic_control_charging) {
+            if (!strcmp(p->payload, "start")) return(v->chargingState == STATE_CHARGING);
+            return((v->chargingState != STATE_UNKNOWN) && (v->chargingState != STATE_CHARGING));
+        }
+    }
+    return(1);
+}
+
+// Called when WeConnect reports a new charging state or charging power.
+void confirm_commands(mqttattr *mqtta) {
+    long long latency;
+    int i;
+
+    for (i = 0; i < PENDING_SIZE; i++) {
+        pending *p = &mqtta->pending[i];
+        if (!p->active || p->failed || !command_confirmed(mqtta, p)) continue;
+
+        latency = now_us() - p->first_us;
+        mqtta->confirm_count++;
+        mqtta->confirm_latency_sum_us += latency;
+        if (latency > mqtta->confirm_latency_max_us) mqtta->confirm_latency_max_us = latency;
+        histogram_add(&mqtta->hist_confirm, latency / 1e6);
+        log_msg(LOG_INFO, "confirmed: %s after %.1f s (%d retries)", p->payload, latency / 1e6, p->retries);
+        p->active = 0;
+    }
+    return;
+}
+
+// Forgets the unconfirmed commands of a car that is no longer controlled.
+void clear_pending(mqttattr *mqtta, vehicle *v) {
+    int i;
+
+    for (i = 0; i < PENDING_SIZE; i++) {
+        pending *p = &mqtta->pending[i];
+        if ((p->topic == v->topic_control_charging) || (p->topic == v->topic_control_current) || (p->topic == v->topic_control_target_soc))
+            p->active = 0;
+    }
+    return;
+}
+
+// Repeats unconfirmed commands with doubled timeout. After CONFIRM_RETRIES the command is given
+// up and the same command is blocked for one more timeout.
+void retry_commands(mqttattr *mqtta) {
+    long long t = now_us();
+    int i;
+
+    for (i = 0; i < PENDING_SIZE; i++) {
+        pending *p = &mqtta->pending[i];
+        if (!p->active || (t < p->deadline_us)) continue;
+
+        if (p->failed) {
+            p->active = 0;
+        } else if (p->retries >= CONFIRM_RETRIES) {
+            log_msg(LOG_INFO, "no confirmation for %s after %d retries", p->payload, p->retries);
+            mqtta->confirm_failures++;
+            p->failed = 1;
+            p->deadline_us = t + 1000000LL * p->timeout;
+        } else {
+            p->retries++;
+            p->timeout *= 2;
+            p->deadline_us = t + 1000000LL * p->timeout;
+            log_msg(LOG_INFO, "retry %d: %s", p->retries, p->payload);
+            count_command(mqtta, p->payload);
+            publish_command(mqtta, p->topic, p->payload);
+        }
+    }
+    return;
+}
+
+void print_command_stats(mqttattr *mqtta) {
+    printf("commands: %ld confirmed", mqtta->confirm_count);
+    if (mqtta->confirm_count) printf(" after avg %.1f s max %.1f s", mqtta->confirm_latency_sum_us / 1e6 / mqtta->confirm_count, mqtta->confirm_latency_max_us / 1e6);
+    printf(", %ld unconfirmed, %ld duplicates suppressed\n", mqtta->confirm_failures, mqtta->commands_suppressed);
+    return;
+}
+
+long charge_cycles(mqttattr *mqtta) {
+    long n = 0;
+    int i;
+
+    for (i = 0; i < mqtta->vehicles; i++) n += mqtta->car[i].cycles;
+    return(n);
+}
+
+int stats_json(mqttattr *mqtta, char *buf, int size) {
+    int n, i;
+
+    n = snprintf(buf, size, "{\"messages\":{");
+    for (i = FIELD_NONE + 1; i < FIELD_COUNT; i++)
+        n += snprintf(buf + n, (n < size) ? size - n : 0, "%s\"%s\":%ld", (i > FIELD_NONE + 1) ? "," : "", field_name[i], mqtta->field_count[i]);
+    n += snprintf(buf + n, (n < size) ? size - n : 0, "},\"evaluations\":%ld,\"commands\":{", mqtta->evaluations);
+    for (i = 0; i < COMMAND_TYPES; i++)
+        n += snprintf(buf + n, (n < size) ? size - n : 0, "%s\"%s\":%ld", i ? "," : "", command_name[i], mqtta->command_count[i]);
+    n += snprintf(buf + n, (n < size) ? size - n : 0, "},\"publish_errors\":%ld,\"reconnects\":%ld,\"rx_dropped\":%ld",
+        (long)mqtta->publish_errors, (mqtta->connects > 0) ? (long)mqtta->connects - 1 : 0, (long)mqtta->rx_dropped);
+    n += snprintf(buf + n, (n < size) ? size - n : 0, ",\"cycles\":%ld,\"forecast_held\":{\"start\":%ld,\"stop\":%ld}",
+        charge_cycles(mqtta), mqtta->forecast.held_starts, mqtta->forecast.held_stops);
+    n += snprintf(buf + n, (n < size) ? size - n : 0, ",\"decision_latency_s\":{\"count\":%ld,\"avg\":%.3f}",
+        mqtta->hist_decision.count, mqtta->hist_decision.count ? mqtta->hist_decision.sum / mqtta->hist_decision.count : 0);
+    n += snprintf(buf + n, (n < size) ? size - n : 0, ",\"confirm_latency_s\":{\"count\":%ld,\"avg\":%.1f,\"max\":%.1f}}",
+        mqtta->hist_confirm.count, mqtta->hist_confirm.count ? mqtta->hist_confirm.sum / mqtta->hist_confirm.count : 0, mqtta->confirm_latency_max_us / 1e6);
+    return(n);
+}
+
+int prometheus_histogram(histogram *h, const char *name, char *buf, int size) {
+    long cumulative = 0;
+    int n, i;
+
+    n = snprintf(buf, size, "# TYPE %s histogram\n", name);
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        cumulative += h->counts[i];
+        if (i < HIST_BUCKETS - 1) n += snprintf(buf + n, (n < size) ? size - n : 0, "%s_bucket{le=\"%g\"} %ld\n", name, h->bounds[i], cumulative);
+        else n += snprintf(buf + n, (n < size) ? size - n : 0, "%s_bucket{le=\"+Inf\"} %ld\n", name, cumulative);
+    }
+    n += snprintf(buf + n, (n < size) ? size - n : 0, "%s_sum %f\n%s_count %ld\n", name, h->sum, name, h->count);
+    return(n);
+}
+
+int stats_prometheus(mqttattr *mqtta, char *buf, int size) {
+    int n, i;
+
+    n = snprintf(buf, size, "# TYPE chargemanager_messages_total counter\n");
+    for (i = FIELD_NONE + 1; i < FIELD_COUNT; i++)
+        n += snprintf(buf + n, (n < size) ? size - n : 0, "chargemanager_messages_total{field=\"%s\"} %ld\n", field_name[i], mqtta->field_count[i]);
+    n += snprintf(buf + n, (n < size) ? size - n : 0, "# TYPE chargemanager_evaluations_total counter\nchargemanager_evaluations_total %ld\n", mqtta->evaluations);
+    n += snprintf(buf + n, (n < size) ? size - n : 0, "# TYPE chargemanager_commands_total counter\n");
+    for (i = 0; i < COMMAND_TYPES; i++)
+        n += snprintf(buf + n, (n < size) ? size - n : 0, "chargemanager_commands_total{command=\"%s\"} %ld\n", command_name[i], mqtta->command_count[i]);
+    n += snprintf(buf + n, (n < size) ? size - n : 0, "# TYPE chargemanager_publish_errors_total counter\nchargemanager_publish_errors_total %ld\n", (long)mqtta->publish_errors);
+    n += snprintf(buf + n, (n < size) ? size - n : 0, "# TYPE chargemanager_reconnects_total counter\nchargemanager_reconnects_total %ld\n", (mqtta->connects > 0) ? (long)mqtta->connects - 1 : 0);
+    n += snprintf(buf + n, (n < size) ? size - n : 0, "# TYPE chargemanager_rx_dropped_total counter\nchargemanager_rx_dropped_total %ld\n", (long)mqtta->rx_dropped);
+    n += snprintf(buf + n, (n < size) ? size - n : 0, "# TYPE chargemanager_charge_cycles_total counter\nchargemanager_charge_cycles_total %ld\n", charge_cycles(mqtta));
+    n += snprintf(buf + n, (n < size) ? size - n : 0, "# TYPE chargemanager_forecast_held_total counter\nchargemanager_forecast_held_total{command=\"start\"} %ld\nchargemanager_forecast_held_total{command=\"stop\"} %ld\n",
+        mqtta->forecast.held_starts, mqtta->forecast.held_stops);
+    n += prometheus_histogram(&mqtta->hist_decision, "chargemanager_decision_latency_seconds", buf + n, (n < size) ? size - n : 0);
+    n += prometheus_histogram(&mqtta->hist_confirm, "chargemanager_confirm_latency_seconds", buf + n, (n < size) ? size - n : 0);
+    return(n);
+}
+
+// Publishes the statistics retained to chargemanager/<vin>/stats.
+void publish_stats(mqttattr *mqtta) {
+    command cmd;
+
+    if (mqtta->replay || !mqtta->topic_stats) return;
+
+    cmd.data = malloc(STATS_LEN);
+    if (!cmd.data) return;
+    stats_json(mqtta, cmd.data, STATS_LEN);
+    cmd.topic = mqtta->topic_stats;
+    cmd.payload[0] = 0;
+    cmd.retain = 1;
+    submit_command(mqtta, &cmd);
+    return;
+}
+
+static void catch_signal(int sig) {
+    printf("\nProgram stopped by user.");
+    go = 0;
+}
+
+static void catch_reload(int sig) {
+    reload = 1;
+}
+
+int regex_match(char *string, char *pattern) {
+    regex_t preg;
+    size_t nmatch = 1;
+    regmatch_t pmatch[nmatch];
+
+    if (regcomp(&preg, pattern, REG_EXTENDED | REG_NEWLINE))
+        return(0);
+    if (regexec(&preg, string, nmatch, pmatch, 0) == REG_NOMATCH) {
+        regfree(&preg);
+        return(0);
+    } else {
+        regfree(&preg);
+        return(1);
+    }
+}
+
+void connect_callback(struct mosquitto *mosq, void *obj, int result) {
+    mqttattr *mqtta = obj;
+
+    if (!result) {
+        mosquitto_subscribe_multiple(mosq, NULL, mqtta->tlen, (char *const *const)mqtta->topics, mqtta->qos, 0, NULL);
+
+        if (mqtta->verbose) {
+            log_msg(LOG_DEBUG, "Source MQTT broker connected.");
+            int i;
+            for (i = 0; i < mqtta->tlen; i++)
+                log_msg(LOG_DEBUG, "topic '%s' subscribed.", mqtta->topics[i]);
+        }
+
+        mqtta->online = 1;
+        mqtta->connects++;
+        flush_commands(mqtta);
+    }
+    return;
+}
+
+void disconnect_callback(struct mosquitto *mosq, void *obj, int result) {
+    mqttattr *mqtta = obj;
+    int i;
+
+    mqtta->online = 0;
+
+    // with qos 1 and 2 the library resends its in-flight messages after the reconnect under the same mid,
+    // only qos 0 messages that were never written are lost with the connection and sent again
+    if (mqtta->qos > 0) return;
+    for (i = 0; i < mqtta->cmdq_len; i++)
+        mqtta->cmdq[(mqtta->cmdq_head + i) % COMMAND_QUEUE_SIZE].mid = -1;
+    return;
+}
+
+void publish_callback(struct mosquitto *mosq, void *obj, int mid) {
+    mqttattr *mqtta = obj;
+    long long latency;
+    int i;
+
+    for (i = 0; i < mqtta->cmdq_len; i++) {
+        command *cmd = &mqtta->cmdq[(mqtta->cmdq_head + i) % COMMAND_QUEUE_SIZE];
+        if (cmd->mid != mid) continue;
+
+        latency = now_us() - cmd->queued_us;
+        mqtta->publish_count++;
+        mqtta->publish_latency_sum_us += latency;
+        if (latency > mqtta->publish_latency_max_us) mqtta->publish_latency_max_us = latency;
+        log_msg(LOG_DEBUG, "publish: >%s< >%s< successfully done (%.1f ms).", cmd->topic, cmd->data ? cmd->data : cmd->payload, latency / 1000.0);
+
+        // remove the entry, commands are small so shifting the tail is cheap
+        if (cmd->data) free(cmd->data);
+        for (; i < mqtta->cmdq_len - 1; i++)
+            mqtta->cmdq[(mqtta->cmdq_head + i) % COMMAND_QUEUE_SIZE] = mqtta->cmdq[(mqtta->cmdq_head + i + 1) % COMMAND_QUEUE_SIZE];
+        mqtta->cmdq_len--;
+        break;
+    }
+    return;
+}
+
+// Converts a message into a sample, returns 0 if the message is not used.
+// Runs on the network thread in threaded mode, so it must not touch the state.
+// Parses the payload in place without copies, it is neither terminated nor trusted.
+int parse_sample(int id, const char *payload, int len, sample *smp) {
+    decode_fn decode = field_decode[id % FIELD_COUNT];
+
+    smp->vehicle = id / FIELD_COUNT;
+    smp->field = id % FIELD_COUNT;
+    smp->value = 0;
+    smp->ts_us = now_us();
+    return(decode ? decode(payload, len, &smp->value) : 0);
+}
+
+void json_space(const char **p, const char *end) {
+    while ((*p < end) && isspace((unsigned char)**p)) (*p)++;
+    return;
+}
+
+// Skips a JSON string and copies up to size - 1 characters of it. Returns its length, -1 if unterminated.
+int json_string(const char **p, const char *end, char *out, int size) {
+    int len = 0;
+
+    if ((*p >= end) || (**p != '"')) return(-1);
+    for ((*p)++; (*p < end) && (**p != '"'); (*p)++, len++) {
+        if ((**p == '\\') && (*p + 1 < end)) (*p)++;
+        if (out && (len < size - 1)) out[len] = **p;
+    }
+    if (*p >= end) return(-1);
+    (*p)++;
+    if (out) out[(len < size) ? len : size - 1] = 0;
+    return(len);
+}
+
+// Walks one JSON value of the snapshot. A number becomes a sample if path is one of snapshot_key,
+// everything else is skipped. path is NULL inside arrays and too long keys. Returns 0 if malformed.
+int json_value(const char **p, const char *end, char *path, int plen, int depth, sample *smp, int *n) {
+    const char *s;
+    char close;
+    int f, len, key;
+
+    json_space(p, end);
+    if ((*p >= end) || (depth > JSON_DEPTH)) return(0);
+
+    if ((**p == '{') || (**p == '[')) {
+        close = (**p == '{') ? '}' : ']';
+        (*p)++;
+        json_space(p, end);
+        if ((*p < end) && (**p == close)) {
+            (*p)++;
+            return(1);
+        }
+        while (*p < end) {
+            char *child = NULL;
+            len = 0;
+            if (close == '}') {
+                json_space(p, end);
+                if (path && (plen + 1 < JSON_PATH_LEN)) {
+                    len = plen ? plen + 1 : 0;
+                    if (plen) path[plen] = '/';
+                    key = json_string(p, end, path + len, JSON_PATH_LEN - len);
+                    if (key < 0) return(0);
+                    if (len + key < JSON_PATH_LEN) child = path;
+                    len += key;
+                } else if (json_string(p, end, NULL, 0) < 0) return(0);
+                json_space(p, end);
+                if ((*p >= end) || (**p != ':')) return(0);
+                (*p)++;
+            }
+            if (!json_value(p, end, child, len, depth + 1, smp, n)) return(0);
+            if (path) path[plen] = 0;
+            json_space(p, end);
+            if (*p >= end) return(0);
+            if (**p == close) {
+                (*p)++;
+                return(1);
+            }
+            if (**p != ',') return(0);
+            (*p)++;
+        }
+        return(0);
+    }
+    if (**p == '"') return(json_string(p, end, NULL, 0) >= 0);
+
+    for (s = *p; (*p < end) && !strchr(",]} \t\r\n", **p); (*p)++);
+    if ((*p == s) || !path) return(*p > s);
+    for (f = FIELD_SOLAR_POWER; f < FIELD_CHARGING_STATE; f++) {
+        if (strcmp(path, snapshot_key[f])) continue;
+        // the snapshot has its own format, independent of the source
+        if ((*n < SAMPLES_MAX) && parse_int(s, *p - s, &smp[*n].value)) {
+            smp[*n].vehicle = 0;
+            smp[*n].field = f;
+            smp[*n].ts_us = now_us();
+            (*n)++;
+        }
+        break;
+    }
+    return(1);
+}
+
+// Turns one message into samples, the JSON snapshot carries all site values at once.
+// Returns the number of samples, a malformed snapshot gives none.
+int parse_message(int id, const char *payload, int len, sample *smp) {
+    const char *p = payload;
+    char path[JSON_PATH_LEN] = "";
+    int n = 0;
+
+    if (id != FIELD_SNAPSHOT) return(parse_sample(id, payload, len, smp));
+    if (!json_value(&p, payload + len, path, 0, 0, smp, &n)) return(0);
+    return(n);
+}
+
+// Adds the current surplus to the minute and the slot, a finished minute goes into the trend and
+// a finished slot into the profile of the day.
+void forecast_add(mqttattr *mqtta) {
+    forecast *fc = &mqtta->forecast;
+    long minute = wall_us() / 60000000;
+    double net = mqtta->pv_solar_power - mqtta->pv_home_power;
+    struct tm tm;
+    time_t t;
+    int slot;
+
+    if (!fc->minutes || (mqtta->pv_solar_power < 0)) return;
+
+    if (minute != fc->minute) {
+        // a gap in the data breaks the trend
+        if (minute - fc->minute > FORECAST_TREND) fc->trend_len = 0;
+        else if (fc->minute_n) {
+            fc->trend[fc->trend_pos] = fc->minute_sum / fc->minute_n;
+            fc->trend_pos = (fc->trend_pos + 1) % FORECAST_TREND;
+            if (fc->trend_len < FORECAST_TREND) fc->trend_len++;
+        }
+        fc->minute = minute;
+        fc->minute_sum = 0;
+        fc->minute_n = 0;
+
+        t = minute * 60;
+        localtime_r(&t, &tm);
+        slot = (tm.tm_hour * 60 + tm.tm_min) * FORECAST_SLOTS / 1440;
+        if (slot != fc->slot) {
+            if ((fc->slot >= 0) && fc->slot_n) {
+                double mean = fc->slot_sum / fc->slot_n;
+                if (!fc->days[fc->slot]) fc->profile[fc->slot] = mean;
+                else fc->profile[fc->slot] += FORECAST_DAY_WEIGHT * (mean - fc->profile[fc->slot]);
+                if (fc->days[fc->slot] < FORECAST_DAYS) fc->days[fc->slot]++;
+            }
+            fc->slot = slot;
+            fc->slot_sum = 0;
+            fc->slot_n = 0;
+        }
+    }
+    fc->minute_sum += net;
+    fc->minute_n++;
+    fc->slot_sum += net;
+    fc->slot_n++;
+    return;
+}
+
+// Predicts the change of the surplus in steps of FORECAST_STEP minutes up to the horizon. The trend
+// is the slope of the minute means and is not extrapolated beyond its own length. Once the profile
+// has seen the slots of the horizon on a previous day, its shape counts half.
+void forecast_predict(mqttattr *mqtta) {
+    forecast *fc = &mqtta->forecast;
+    double sx = 0, sy = 0, sxx = 0, sxy = 0, y, slope, d, sum = 0, min = 0;
+    int i, k, s, slot, minute, steps = 0, n = fc->trend_len;
+    struct tm tm;
+    time_t t = wall_us() / 1000000;
+
+    fc->ready = (n >= 3);
+    fc->delta_min = 0;
+    fc->delta_mean = 0;
+    if (!fc->ready) return;
+
+    for (i = 0; i < n; i++) {
+        y = fc->trend[(fc->trend_pos - n + i + FORECAST_TREND) % FORECAST_TREND];
+        sx += i;
+        sy += y;
+        sxx += i * i;
+        sxy += i * y;
+    }
+    slope = (n * sxy - sx * sy) / (n * sxx - sx * sx);
+
+    localtime_r(&t, &tm);
+    minute = tm.tm_hour * 60 + tm.tm_min;
+    slot = minute * FORECAST_SLOTS / 1440;
+    for (k = FORECAST_STEP; k <= fc->minutes; k += FORECAST_STEP) {
+        s = ((minute + k) % 1440) * FORECAST_SLOTS / 1440;
+        d = slope * ((k < FORECAST_TREND) ? k : FORECAST_TREND);
+        if (fc->days[slot] && fc->days[s]) d = (d + fc->profile[s] - fc->profile[slot]) / 2;
+        if (!steps || (d < min)) min = d;
+        sum += d;
+        steps++;
+    }
+    fc->delta_min = min;
+    fc->delta_mean = sum / steps;
+    return;
+}
+
+// Returns 1 if a start or stop of the car may be sent. A start is held unless the surplus is expected
+// to stay above the reduced charging power for the whole horizon, a stop while the surplus is expected
+// to come back, but not longer than the horizon. Holds less than FORECAST_STEP minutes apart count as one.
+int forecast_allows(mqttattr *mqtta, vehicle *v, int kind, int value) {
+    forecast *fc = &mqtta->forecast;
+    int same = (v->held == kind) && (now_s() - v->held_seen_s <= 60 * FORECAST_STEP);
+    int held;
+
+    if (!fc->minutes || !fc->ready) return(1);
+    if (kind == FORECAST_HELD_START) held = (value + fc->delta_min <= REDUCED_CHARGE_POWER);
+    else held = (value + fc->delta_mean >= 0) && !(same && (now_s() - v->held_s >= 60 * fc->minutes));
+    if (!held) return(1);
+
+    v->held_seen_s = now_s();
+    if (!same) {
+        v->held = kind;
+        v->held_s = now_s();
+        if (kind == FORECAST_HELD_START) fc->held_starts++;
+        else fc->held_stops++;
+        log_msg(LOG_INFO, "%sforecast: %s held, %+dW expected within %d min", v->label, (kind == FORECAST_HELD_START) ? "start" : "stop",
+            (kind == FORECAST_HELD_START) ? fc->delta_min : fc->delta_mean, fc->minutes);
+        session_event(mqtta, "forecast", v - mqtta->car, (kind == FORECAST_HELD_START) ? "start_held" : "stop_held",
+            value + ((kind == FORECAST_HELD_START) ? fc->delta_min : fc->delta_mean), NULL);
+    }
+    return(0);
+}
+
+// Sets the deadlines of the watched fields, a missing first value counts from now on.
+void watch_fields(mqttattr *mqtta) {
+    int f;
+
+    mqtta->field_timeout[FIELD_SOLAR_POWER] = mqtta->stale_timeout;
+    mqtta->field_timeout[FIELD_HOME_POWER] = mqtta->stale_timeout;
+    for (f = 0; f < TOPIC_COUNT; f++) mqtta->field_seen_us[f] = now_us();
+    return;
+}
+
+// Re-arms the control in daemon mode at the next plug-in or sunrise.
+void start_session(mqttattr *mqtta, char *reason) {
+    char buffer[16];
+    int i;
+
+    log_msg(LOG_INFO, "session started (%s)", reason);
+    mqtta->session = 1;
+    mqtta->ts_start = now_s();
+    session_open(mqtta);
+    for (i = 0; i < mqtta->vehicles; i++) {
+        mqtta->car[i].active = 1;
+        mqtta->car[i].action = 1;
+        mqtta->car[i].grid_integral = 0;
+        mqtta->car[i].grid_ts_us = 0;
+    }
+    watch_fields(mqtta);
+
+    sprintf(buffer, "%d", INTERVAL_FAST);
+    publish(mqtta, mqtta->topic_control_update_interval, buffer);
+    sprintf(buffer, "%d", mqtta->target_soc);
+    for (i = 0; i < mqtta->vehicles; i++) publish(mqtta, mqtta->car[i].topic_control_target_soc, buffer);
+
+    mqtta->dirty = 1;
+    return;
+}
+
+// Ends the charging session. Without --daemon the program stops, with it the connection and the
+// state are kept until start_session.
+void end_session(mqttattr *mqtta, char *reason) {
+    char buffer[16];
+    int i;
+
+    if (!mqtta->daemon) {
+        log_msg(LOG_INFO, "Stop program because %s.", reason);
+        go = 0;
+        return;
+    }
+    if (!mqtta->session) return;
+
+    log_msg(LOG_INFO, "session ended because %s, waiting for the next plug-in or sunrise", reason);
+    mqtta->session = 0;
+
+    sprintf(buffer, "%d", INTERVAL_DEFAULT);
+    publish(mqtta, mqtta->topic_control_update_interval, buffer);
+    // no retry may restart a car after the session
+    for (i = 0; i < mqtta->vehicles; i++) {
+        clear_pending(mqtta, &mqtta->car[i]);
+        if (mqtta->car[i].chargingState == STATE_CHARGING)
+            publish_command(mqtta, mqtta->car[i].topic_control_charging, (char*)"stop");
+    }
+    publish_stats(mqtta);
+    session_close(mqtta);
+    return;
+}
+
+// Takes a car out of the control, the program stops when no car is left.
+void deactivate_vehicle(mqttattr *mqtta, vehicle *v, char *reason) {
+    int i, n = 0;
+
+    v->active = 0;
+    clear_pending(mqtta, v);
+    for (i = 0; i < mqtta->vehicles; i++)
+        if (mqtta->car[i].active) n++;
+    if (!n) end_session(mqtta, reason);
+    else log_msg(LOG_INFO, "%s: %s, %d car(s) left.", v->vin, reason, n);
+    return;
+}
+
+void apply_sample(mqttattr *mqtta, sample *smp) {
+    char reason[64];
+    vehicle *v = &mqtta->car[smp->vehicle];
+    int id = TOPIC_ID(smp->vehicle, smp->field);
+    int i;
+
+    if (mqtta->verbose) {
+        if (smp->field == FIELD_CHARGING_STATE) log_msg(LOG_DEBUG, ">%s< >%s<", mqtta->topic_name[id], state_name[smp->value]);
+        else if (smp->field == FIELD_MAX_CHARGE_CURRENT) log_msg(LOG_DEBUG, ">%s< >%s<", mqtta->topic_name[id], current_name[smp->value]);
+        else if (smp->field == FIELD_PLUG_CONNECTION) log_msg(LOG_DEBUG, ">%s< >%s<", mqtta->topic_name[id], plug_name[smp->value]);
+        else log_msg(LOG_DEBUG, ">%s< >%d<", mqtta->topic_name[id], smp->value);
+    }
+
+    mqtta->field_seen_us[id] = smp->ts_us;
+    if (smp->field == FIELD_SOLAR_POWER) mqtta->solar_arrival_us = smp->ts_us;
+    mqtta->field_count[smp->field]++;
+
+    if (mqtta->session_log) {
+        const char *text = NULL;
+        if (smp->field == FIELD_CHARGING_STATE) text = state_name[smp->value];
+        else if (smp->field == FIELD_MAX_CHARGE_CURRENT) text = current_name[smp->value];
+        else if (smp->field == FIELD_PLUG_CONNECTION) text = plug_name[smp->value];
+        session_event(mqtta, "sample", SITE_FIELD(smp->field) ? -1 : smp->vehicle, field_name[smp->field], smp->value, text);
+    }
+
+    switch (smp->field) {
+    case FIELD_SOLAR_POWER:
+        if (!mqtta->session && (mqtta->pv_solar_power == 0) && (smp->value > 0)) start_session(mqtta, "sunrise");
+        mqtta->pv_solar_power = smp->value;
+        series_add(&mqtta->power[FIELD_SOLAR_POWER - FIELD_SOLAR_POWER], smp->value, mqtta->window);
+        forecast_add(mqtta);
+        if (mqtta->pv_solar_power == 0) end_session(mqtta, "solar power is 0");
+        else for (i = 0; i < mqtta->vehicles; i++) mqtta->car[i].action = 1;
+        break;
+    case FIELD_HOME_POWER:
+        mqtta->pv_home_power = smp->value;
+        series_add(&mqtta->power[FIELD_HOME_POWER - FIELD_SOLAR_POWER], smp->value, mqtta->window);
+        forecast_add(mqtta);
+        break;
+    case FIELD_GRID_POWER:
+        mqtta->pv_grid_power = smp->value;
+        series_add(&mqtta->power[FIELD_GRID_POWER - FIELD_SOLAR_POWER], smp->value, mqtta->window);
+        break;
+    case FIELD_BATTERY_POWER:
+        mqtta->pv_battery_power = smp->value;
+        series_add(&mqtta->power[FIELD_BATTERY_POWER - FIELD_SOLAR_POWER], smp->value, mqtta->window);
+        break;
+    case FIELD_BATTERY_SOC:
+        mqtta->pv_battery_soc = smp->value;
+        break;
+    case FIELD_CHARGING_STATE:
+        if ((smp->value == STATE_CHARGING) && (v->chargingState != STATE_CHARGING) && (v->chargingState != STATE_UNKNOWN)) v->cycles++;
+        v->chargingState = smp->value;
+        confirm_commands(mqtta);
+        v->action = 1;
+        break;
+    case FIELD_CURRENT_SOC:
+        v->currentSOC_pct = smp->value;
+        break;
+    case FIELD_TARGET_SOC:
+        v->targetSOC_pct = smp->value;
+        break;
+    case FIELD_RANGE:
+        v->cruisingRangeElectric_km = smp->value;
+        break;
+    case FIELD_MAX_CHARGE_CURRENT:
+        v->maxChargeCurrentAC = smp->value;
+        confirm_commands(mqtta);
+        break;
+    case FIELD_PLUG_CONNECTION:
+        if (smp->value == PLUG_CONNECTED) {
+            if (mqtta->daemon && !v->connected && (mqtta->pv_solar_power > 0)) {
+                if (!mqtta->session) start_session(mqtta, "car has been connected");
+                else if (!v->active) {
+                    v->active = 1;
+                    log_msg(LOG_INFO, "%s: car has been connected", v->vin);
+                }
+            }
+            v->connected = 1;
+        }
+        if (smp->value == PLUG_DISCONNECTED) {
+            if (v->connected && v->active && mqtta->session)
+                deactivate_vehicle(mqtta, v, "car has been disconnected");
+            v->connected = 0;
+        }
+        break;
+    case FIELD_ODOMETER:
+        // the baseline follows the car while it is not managed
+        if ((v->km < 0) || !v->active || !mqtta->session) {
+            if (v->km < 0) log_msg(LOG_INFO, "km = %d", smp->value);
+            v->km = smp->value;
+        } else if (v->km && (smp->value > v->km)) {
+            snprintf(reason, sizeof(reason), "car is moving (km = %d)", smp->value);
+            deactivate_vehicle(mqtta, v, reason);
+        }
+        break;
+    default:
+        break;
+    }
+
+    mqtta->dirty = 1;
+
+    return;
+}
+
+// Record: 8 byte time (us since epoch), 1 byte topic id, 2 byte payload length, payload.
+void record_message(FILE *f, int id, const struct mosquitto_message *message) {
+    unsigned char head[11];
+    long long t = wall_us();
+    int len = (message->payloadlen > RECORD_PAYLOAD_MAX) ? RECORD_PAYLOAD_MAX : message->payloadlen;
+    int i;
+
+    if (len < 0) len = 0;
+    for (i = 0; i < 8; i++) head[i] = (t >> (8 * i)) & 0xff;
+    head[8] = id;
+    head[9] = len & 0xff;
+    head[10] = (len >> 8) & 0xff;
+    fwrite(head, 1, sizeof(head), f);
+    fwrite(message->payload, 1, len, f);
+    return;
+}
+
+void message_callback(struct mosquitto *mosq, void *obj, const struct mosquitto_message *message) {
+    mqttattr *mqtta = obj;
+    sample smp[SAMPLES_MAX];
+    int id = topic_lookup(mqtta, message->topic);
+    int i, n;
+
+    n = parse_message(id, message->payload, message->payloadlen, smp);
+    if (!n) return;
+
+    if (mqtta->record) record_message(mqtta->record, id, message);
+
+#if defined(__linux__)
+    if (mqtta->threaded) {
+        uint64_t one = 1;
+        for (i = 0; i < n; i++)
+            if (!ring_push(&mqtta->rx, &smp[i])) mqtta->rx_dropped++;
+        if (write(mqtta->rx_fd, &one, sizeof(one)) < 0) mqtta->rx_dropped++;
+        return;
+    }
+#endif
+    for (i = 0; i < n; i++) apply_sample(mqtta, &smp[i]);
+
+    return;
+}
+
+// Open loop control on the surplus share of the car.
+void control_surplus(mqttattr *mqtta, vehicle *v) {
+    if (v->action && ((now_s() - v->ts_last) > INTERVAL_FAST)) {
+        v->action = 0;
+        v->ts_last = now_s();
+
+        // Power
+        if (mqtta->reduced && (v->maxChargeCurrentAC != CURRENT_REDUCED)) {
+            if (send_command(mqtta, v->topic_control_current, (char*)"reduced"))
+                log_msg(LOG_INFO, "%spublished: switch to reduced charging power (reduced mode)", v->label);
+        } else if (!mqtta->reduced && (v->chargingState == STATE_CHARGING) && (v->share > REDUCED_CHARGE_POWER)) {
+            if (v->maxChargeCurrentAC != CURRENT_MAXIMUM) {
+                if (send_command(mqtta, v->topic_control_current, (char*)"maximum"))
+                    log_msg(LOG_INFO, "%spublished: switch to maximum charging power", v->label);
+            }
+        } else if (!mqtta->reduced && (v->chargingState == STATE_CHARGING) && (v->share < 0)) {
+            if (v->maxChargeCurrentAC != CURRENT_REDUCED) {
+                if (send_command(mqtta, v->topic_control_current, (char*)"reduced"))
+                    log_msg(LOG_INFO, "%spublished: switch to reduced charging power", v->label);
+            }
+        }
+
+        // Charging
+        if ((v->chargingState == STATE_READY_FOR_CHARGING) && (v->share > REDUCED_CHARGE_POWER)) {
+            if (forecast_allows(mqtta, v, FORECAST_HELD_START, v->share) && send_command(mqtta, v->topic_control_charging, (char*)"start"))
+                log_msg(LOG_INFO, "%spublished: start charging", v->label);
+        } else if ((v->chargingState == STATE_CHARGING) && (v->share < -250) && (v->maxChargeCurrentAC == CURRENT_REDUCED)) {
+            if (forecast_allows(mqtta, v, FORECAST_HELD_STOP, v->share) && send_command(mqtta, v->topic_control_charging, (char*)"stop"))
+                log_msg(LOG_INFO, "%spublished: stop charging", v->label);
+        }
+    }
+
+    return;
+}
+
+// Deviation of the measured grid export from the setpoint. House battery power counts as export
+// as far as the car may use it (see --battery and the hysteresis).
+int grid_error(mqttattr *mqtta) {
+    int grid = smoothed(mqtta, FIELD_GRID_POWER);
+    int battery = smoothed(mqtta, FIELD_BATTERY_POWER);
+    int measured, e;
+
+    measured = -grid;
+    if (mqtta->pump == 1) measured += battery + mqtta->battery_max;
+    else if (battery > mqtta->battery) measured += battery - mqtta->battery;
+
+    e = measured - mqtta->grid_setpoint;
+    if (abs(e) <= mqtta->grid_deadband) e = 0;
+    return(e);
+}
+
+// Closed loop control on the share of the grid deviation assigned to the car. A PI controller
+// drives the export toward the setpoint, the integral is neither accumulated into a saturated
+// actuator nor kept after a command, and commands are at least min_interval seconds apart.
+void control_grid(mqttattr *mqtta, vehicle *v) {
+    long long t = now_us();
+    double dt = v->grid_ts_us ? (t - v->grid_ts_us) / 1e6 : 0;
+    double limit = (double)REDUCED_CHARGE_POWER * GRID_INTEGRAL_TIME;
+    int e = v->share;
+    int level, level_max, start, stop, sent = 0;
+
+    v->grid_ts_us = t;
+
+    if (v->chargingState != STATE_CHARGING) level = 0;
+    else if (v->maxChargeCurrentAC != CURRENT_MAXIMUM) level = 1;
+    else level = 2;
+    level_max = mqtta->reduced ? 1 : 2;
+
+    if (!((e > 0) && (level >= level_max)) && !((e < 0) && (level == 0)))
+        v->grid_integral += e * dt;
+    if (v->grid_integral > limit) v->grid_integral = limit;
+    if (v->grid_integral < -limit) v->grid_integral = -limit;
+
+    v->grid_output = e + (int)(v->grid_integral / GRID_INTEGRAL_TIME);
+
+    if (now_s() - v->ts_last < mqtta->min_interval) return;
+
+    start = (level == 0) && (v->chargingState == STATE_READY_FOR_CHARGING) && (v->grid_output > REDUCED_CHARGE_POWER);
+    stop = (level == 1) && (v->grid_output < -mqtta->grid_deadband - 250);
+
+    if ((level == 2) && mqtta->reduced) {
+        sent = send_command(mqtta, v->topic_control_current, (char*)"reduced");
+        if (sent) log_msg(LOG_INFO, "%spublished: switch to reduced charging power (reduced mode)", v->label);
+    } else if (start && forecast_allows(mqtta, v, FORECAST_HELD_START, v->grid_output)) {
+        sent = send_command(mqtta, v->topic_control_charging, (char*)"start");
+        if (sent) log_msg(LOG_INFO, "%spublished: start charging (u=%dW)", v->label, v->grid_output);
+    } else if ((level == 1) && (level < level_max) && (v->grid_output > REDUCED_CHARGE_POWER)) {
+        sent = send_command(mqtta, v->topic_control_current, (char*)"maximum");
+        if (sent) log_msg(LOG_INFO, "%spublished: switch to maximum charging power (u=%dW)", v->label, v->grid_output);
+    } else if ((level == 2) && (v->grid_output < -mqtta->grid_deadband)) {
+        sent = send_command(mqtta, v->topic_control_current, (char*)"reduced");
+        if (sent) log_msg(LOG_INFO, "%spublished: switch to reduced charging power (u=%dW)", v->label, v->grid_output);
+    } else if (stop && forecast_allows(mqtta, v, FORECAST_HELD_STOP, v->grid_output)) {
+        sent = send_command(mqtta, v->topic_control_charging, (char*)"stop");
+        if (sent) log_msg(LOG_INFO, "%spublished: stop charging (u=%dW)", v->label, v->grid_output);
+    }
+    if (!sent) return;
+
+    v->ts_last = now_s();
+    v->grid_integral = 0;
+    return;
+}
+
+// Splits the site surplus (or grid deviation) between the cars. A positive value goes to cars that
+// can take more power, a deficit to cars that are charging. One car gets a deficit and, with priority
+// or SOC allocation, also the whole surplus, so two cars never react to the same value.
+void allocate(mqttattr *mqtta, int surplus) {
+    vehicle *eligible[VEHICLES_MAX];
+    vehicle *x;
+    int i, j, n = 0;
+
+    for (i = 0; i < mqtta->vehicles; i++) {
+        vehicle *v = &mqtta->car[i];
+        int charging = (v->chargingState == STATE_CHARGING);
+        int at_max = (v->maxChargeCurrentAC == (mqtta->reduced ? CURRENT_REDUCED : CURRENT_MAXIMUM));
+
+        v->share = 0;
+        if (!v->active) continue;
+        if ((surplus > 0) && ((v->chargingState == STATE_READY_FOR_CHARGING) || (charging && !at_max))) eligible[n++] = v;
+        else if ((surplus < 0) && charging) eligible[n++] = v;
+    }
+    if (!n) return;
+
+    // order of the --vin options, or the lowest SOC first
+    if (mqtta->allocation != ALLOCATION_PRIORITY) {
+        for (i = 1; i < n; i++) {
+            x = eligible[i];
+            for (j = i; (j > 0) && (eligible[j - 1]->currentSOC_pct > x->currentSOC_pct); j--) eligible[j] = eligible[j - 1];
+            eligible[j] = x;
+        }
+    }
+
+    // fair: equal shares between as many cars as the surplus can charge with reduced power, a deficit
+    // goes to one car like with the other modes, so the stop threshold is not divided between them
+    if ((mqtta->allocation == ALLOCATION_FAIR) && (surplus > 0)) {
+        if (surplus / REDUCED_CHARGE_POWER < n) n = surplus / REDUCED_CHARGE_POWER;
+        if (n < 1) n = 1;
+        for (i = 0; i < n; i++) eligible[i]->share = surplus / n;
+        return;
+    }
+
+    if (surplus > 0) eligible[0]->share = surplus;
+    else eligible[n - 1]->share = surplus;
+    return;
+}
+
+// Runs the control decision on the current state. Called from the tick, never from a message.
+void evaluate(mqttattr *mqtta) {
+    int solar = smoothed(mqtta, FIELD_SOLAR_POWER);
+    int home = smoothed(mqtta, FIELD_HOME_POWER);
+    int i;
+
+    if (mqtta->pv_solar_power <= 0)
+        mqtta->power_available = 0;
+    else if ((mqtta->pv_battery_soc >= mqtta->hysteresis_max) && (mqtta->pump == 0)) {
+        mqtta->pump = 1;
+        mqtta->power_available = solar - home + mqtta->battery_max;
+    } else if ((mqtta->pv_battery_soc < mqtta->hysteresis_min) && (mqtta->pump == 1)) {
+        mqtta->pump = 0;
+        mqtta->power_available = solar - home - mqtta->battery;
+    } else if (mqtta->pump == 1)
+        mqtta->power_available = solar - home + mqtta->battery_max;
+    else
+        mqtta->power_available = solar - home - mqtta->battery;
+
+    if (mqtta->forecast.minutes) forecast_predict(mqtta);
+    mqtta->decision_us = wall_us();
+    allocate(mqtta, (mqtta->control == CONTROL_GRID) ? grid_error(mqtta) : mqtta->power_available);
+    session_event(mqtta, "decision", -1, "surplus", mqtta->power_available, NULL);
+
+    for (i = 0; i < mqtta->vehicles; i++) {
+        vehicle *v = &mqtta->car[i];
+        if (!v->active) continue;
+        session_event(mqtta, "decision", i, (mqtta->control == CONTROL_GRID) ? "grid" : "share", v->share, state_name[v->chargingState]);
+        if (mqtta->control == CONTROL_GRID) control_grid(mqtta, v);
+        else control_surplus(mqtta, v);
+    }
+
+    return;
+}
+
+// Refreshed at a fixed rate on a terminal only, a log file gets the events instead.
+void status_line(mqttattr *mqtta) {
+    char timestamp[24];
+    char line[LOG_LINE_LEN];
+    int i, n;
+
+    if (!logs.tty || mqtta->replay) return;
+
+    now(timestamp);
+    if (mqtta->vehicles == 1) {
+        vehicle *v = &mqtta->car[0];
+        log_msg(LOG_STATUS, "[%s] SOC=%d(%d) Range=%dkm surplus=%dW State: %s %s", timestamp, v->currentSOC_pct, v->targetSOC_pct, v->cruisingRangeElectric_km, mqtta->power_available, state_name[v->chargingState], current_name[v->maxChargeCurrentAC]);
+        return;
+    }
+    n = snprintf(line, sizeof(line), "[%s] surplus=%dW", timestamp, mqtta->power_available);
+    for (i = 0; i < mqtta->vehicles; i++)
+        n += snprintf(line + n, (n < (int)sizeof(line)) ? sizeof(line) - n : 0, " | SOC=%d(%d) %s %s", mqtta->car[i].currentSOC_pct, mqtta->car[i].targetSOC_pct, state_name[mqtta->car[i].chargingState], current_name[mqtta->car[i].maxChargeCurrentAC]);
+    log_msg(LOG_STATUS, "%s", line);
+    return;
+}
+
+// Maps the state file and creates it if necessary.
+int state_open(mqttattr *mqtta, char *file) {
+    void *p;
+    int fd;
+
+    fd = open(file, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return(0);
+    if (ftruncate(fd, sizeof(saved_state))) {
+        close(fd);
+        return(0);
+    }
+    p = mmap(NULL, sizeof(saved_state), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return(0);
+    mqtta->saved = (saved_state*)p;
+    return(1);
+}
+
+// Takes over the state of a recent previous run, so that the first tick can decide without waiting
+// for WeConnect. Retained and new messages overwrite it as they arrive. Returns the number of cars.
+int state_restore(mqttattr *mqtta) {
+    saved_state *s = mqtta->saved;
+    long long age;
+    int i, j, n = 0;
+
+    if (!s || memcmp(s->magic, STATE_MAGIC, sizeof(s->magic)) || (s->size != sizeof(saved_state))) return(0);
+    // the profile of the day stays valid for longer than the state
+    for (i = 0; i < FORECAST_SLOTS; i++) {
+        if ((s->days[i] < 0) || (s->days[i] > FORECAST_DAYS)) continue;
+        mqtta->forecast.profile[i] = s->profile[i];
+        mqtta->forecast.days[i] = s->days[i];
+    }
+    age = (wall_us() - s->saved_us) / 1000000;
+    if ((age < 0) || (age > STATE_MAX_AGE) || (s->vehicles < 0) || (s->vehicles > VEHICLES_MAX)) return(0);
+
+    for (i = 0; i < mqtta->vehicles; i++) {
+        vehicle *v = &mqtta->car[i];
+        for (j = 0; j < s->vehicles; j++) {
+            vehicle_state *vs = &s->car[j];
+            if (strncmp(vs->vin, v->vin, sizeof(vs->vin))) continue;
+            if ((vs->chargingState >= 0) && (vs->chargingState < STATE_COUNT)) v->chargingState = vs->chargingState;
+            if ((vs->maxChargeCurrentAC >= 0) && (vs->maxChargeCurrentAC < CURRENT_COUNT)) v->maxChargeCurrentAC = vs->maxChargeCurrentAC;
+            v->currentSOC_pct = vs->currentSOC_pct;
+            v->targetSOC_pct = vs->targetSOC_pct;
+            v->cruisingRangeElectric_km = vs->cruisingRangeElectric_km;
+            v->km = vs->km;
+            v->connected = vs->connected;
+            if (vs->ts_last_us) v->ts_last = now_s() - (wall_us() - vs->ts_last_us) / 1000000;
+            v->grid_integral = vs->grid_integral;
+            v->action = 1;
+            n++;
+            break;
+        }
+    }
+    if (!n) return(0);
+
+    mqtta->pv_solar_power = s->pv_solar_power;
+    mqtta->pv_home_power = s->pv_home_power;
+    mqtta->pv_grid_power = s->pv_grid_power;
+    mqtta->pv_battery_power = s->pv_battery_power;
+    mqtta->pv_battery_soc = s->pv_battery_soc;
+    series_add(&mqtta->power[FIELD_SOLAR_POWER - FIELD_SOLAR_POWER], s->pv_solar_power, mqtta->window);
+    series_add(&mqtta->power[FIELD_HOME_POWER - FIELD_SOLAR_POWER], s->pv_home_power, mqtta->window);
+    series_add(&mqtta->power[FIELD_GRID_POWER - FIELD_SOLAR_POWER], s->pv_grid_power, mqtta->window);
+    series_add(&mqtta->power[FIELD_BATTERY_POWER - FIELD_SOLAR_POWER], s->pv_battery_power, mqtta->window);
+    // only the hysteresis state, -1 of a run with --no_hysteresis must not switch it off for this run
+    if ((mqtta->pump != -1) && ((s->pump == 0) || (s->pump == 1))) mqtta->pump = s->pump;
+    mqtta->dirty = 1;
+    return(n);
+}
+
+void state_save(mqttattr *mqtta) {
+    saved_state *s = mqtta->saved;
+    long long t = wall_us();
+    int i;
+
+    if (!s) return;
+
+    memcpy(s->magic, STATE_MAGIC, sizeof(s->magic));
+    s->size = sizeof(saved_state);
+    s->saved_us = t;
+    s->pv_solar_power = mqtta->pv_solar_power;
+    s->pv_home_power = mqtta->pv_home_power;
+    s->pv_grid_power = mqtta->pv_grid_power;
+    s->pv_battery_power = mqtta->pv_battery_power;
+    s->pv_battery_soc = mqtta->pv_battery_soc;
+    s->pump = mqtta->pump;
+    s->vehicles = mqtta->vehicles;
+    for (i = 0; i < mqtta->vehicles; i++) {
+        vehicle *v = &mqtta->car[i];
+        vehicle_state *vs = &s->car[i];
+        memcpy(vs->vin, v->vin, sizeof(vs->vin));
+        vs->chargingState = v->chargingState;
+        vs->maxChargeCurrentAC = v->maxChargeCurrentAC;
+        vs->currentSOC_pct = v->currentSOC_pct;
+        vs->targetSOC_pct = v->targetSOC_pct;
+        vs->cruisingRangeElectric_km = v->cruisingRangeElectric_km;
+        vs->km = v->km;
+        vs->connected = v->connected;
+        vs->ts_last_us = v->ts_last ? t - 1000000LL * (now_s() - v->ts_last) : 0;
+        vs->grid_integral = v->grid_integral;
+    }
+    memcpy(s->profile, mqtta->forecast.profile, sizeof(s->profile));
+    memcpy(s->days, mqtta->forecast.days, sizeof(s->days));
+    return;
+}
+
+void state_close(mqttattr *mqtta) {
+    if (!mqtta->saved) return;
+    state_save(mqtta);
+    munmap(mqtta->saved, sizeof(saved_state));
+    mqtta->saved = NULL;
+    return;
+}
+
+// Creates the shared memory export /dev/shm/<name>, readers map it read-only.
+int shared_open(mqttattr *mqtta, char *name) {
+    void *p;
+    int fd;
+
+    snprintf(mqtta->shared_name, SHARED_NAME_LEN, "%s%s", (name[0] == '/') ? "" : "/", name);
+    fd = shm_open(mqtta->shared_name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return(0);
+    if (ftruncate(fd, sizeof(shared_state))) {
+        close(fd);
+        return(0);
+    }
+    p = mmap(NULL, sizeof(shared_state), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return(0);
+    mqtta->shared = (shared_state*)p;
+    memset(mqtta->shared, 0, sizeof(shared_state));
+    memcpy(mqtta->shared->magic, SHARED_MAGIC, sizeof(mqtta->shared->magic));
+    mqtta->shared->size = sizeof(shared_state);
+    return(1);
+}
+
+// Writes the current view under the sequence lock, the main thread is the only writer.
+void shared_update(mqttattr *mqtta, int running) {
+    shared_state *s = mqtta->shared;
+    unsigned int seq;
+    int i;
+
+    if (!s) return;
+
+    seq = atomic_load_explicit(&s->seq, memory_order_relaxed);
+    atomic_store_explicit(&s->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    s->running = running;
+    s->pid = getpid();
+    s->session = mqtta->session;
+    s->updated_us = wall_us();
+    s->decision_us = mqtta->decision_us;
+    s->evaluations = mqtta->evaluations;
+    s->solar_power = mqtta->pv_solar_power;
+    s->home_power = mqtta->pv_home_power;
+    s->grid_power = mqtta->pv_grid_power;
+    s->battery_power = mqtta->pv_battery_power;
+    s->battery_soc = mqtta->pv_battery_soc;
+    s->surplus = mqtta->power_available;
+    s->pump = mqtta->pump;
+    s->hysteresis_min = mqtta->hysteresis_min;
+    s->hysteresis_max = mqtta->hysteresis_max;
+    s->target_soc = mqtta->target_soc;
+    s->control = mqtta->control;
+    s->vehicles = mqtta->vehicles;
+    for (i = 0; i < mqtta->vehicles; i++) {
+        vehicle *v = &mqtta->car[i];
+        shared_vehicle *sv = &s->car[i];
+        memcpy(sv->vin, v->vin, sizeof(sv->vin));
+        sv->active = v->active;
+        sv->connected = v->connected;
+        sv->current_soc = v->currentSOC_pct;
+        sv->target_soc = v->targetSOC_pct;
+        sv->range_km = v->cruisingRangeElectric_km;
+        snprintf(sv->charging_state, sizeof(sv->charging_state), "%s", state_name[v->chargingState]);
+        snprintf(sv->charge_current, sizeof(sv->charge_current), "%s", current_name[v->maxChargeCurrentAC]);
+        sv->share = v->share;
+        sv->grid_output = v->grid_output;
+        memcpy(sv->command, v->command, sizeof(sv->command));
+        sv->command_us = v->command_us;
+    }
+
+    atomic_store_explicit(&s->seq, seq + 2, memory_order_release);
+    return;
+}
+
+// The segment is kept with running = 0, so that readers see the last state.
+void shared_close(mqttattr *mqtta) {
+    if (!mqtta->shared) return;
+    shared_update(mqtta, 0);
+    munmap(mqtta->shared, sizeof(shared_state));
+    mqtta->shared = NULL;
+    return;
+}
+
+// Applies one setting of the command line or the config file. Returns the number of arguments it
+// takes, 0 if name is no setting or its value is missing. A flag is switched off by the value 0.
+int parse_setting(mqttattr *c, const char *name, const char *value) {
+    int off = value && !strcmp(value, "0");
+
+    if (!strcmp(name, "no_hysteresis")) {
+        c->pump = off ? 0 : -1;
+        return(1);
+    }
+    if (!strcmp(name, "reduced")) {
+        c->reduced = !off;
+        return(1);
+    }
+    if (!value) return(0);
+    if (!strcmp(name, "battery")) c->battery = abs(atoi(value));
+    else if (!strcmp(name, "battery_max")) c->battery_max = abs(atoi(value));
+    else if (!strcmp(name, "hysteresis_min")) c->hysteresis_min = abs(atoi(value));
+    else if (!strcmp(name, "hysteresis_max")) c->hysteresis_max = abs(atoi(value));
+    else if (!strcmp(name, "target_soc")) c->target_soc = abs(atoi(value));
+    else if (!strcmp(name, "allocation")) {
+        if (!strcmp(value, "fair")) c->allocation = ALLOCATION_FAIR;
+        else if (!strcmp(value, "soc")) c->allocation = ALLOCATION_SOC;
+        else c->allocation = ALLOCATION_PRIORITY;
+    }
+    else if (!strcmp(name, "control")) c->control = strcmp(value, "grid") ? CONTROL_SURPLUS : CONTROL_GRID;
+    else if (!strcmp(name, "grid_setpoint")) c->grid_setpoint = atoi(value);
+    else if (!strcmp(name, "grid_deadband")) c->grid_deadband = abs(atoi(value));
+    else if (!strcmp(name, "smoothing")) {
+        if (!strcmp(value, "none")) c->smoothing = SMOOTHING_NONE;
+        else if (!strcmp(value, "ewma")) c->smoothing = SMOOTHING_EWMA;
+        else if (!strcmp(value, "mean")) c->smoothing = SMOOTHING_MEAN;
+        else c->smoothing = SMOOTHING_MEDIAN;
+    }
+    else if (!strcmp(name, "window")) c->window = abs(atoi(value));
+    else if (!strcmp(name, "min_interval")) c->min_interval = abs(atoi(value));
+    else if (!strcmp(name, "forecast")) c->forecast.minutes = abs(atoi(value));
+    else if (!strcmp(name, "runtime")) c->runtime = abs(atoi(value));
+    else if (!strcmp(name, "tick")) c->tick_ms = abs(atoi(value));
+    else if (!strcmp(name, "stale")) c->stale_timeout = abs(atoi(value));
+    else return(0);
+    return(2);
+}
+
+// Invalid values are replaced by the defaults.
+void check_settings(mqttattr *c) {
+    if ((c->target_soc < 30) || (c->target_soc > 100) || (c->target_soc % 10)) c->target_soc = TARGET_SOC_DEFAULT;
+    if ((c->hysteresis_min < 0) || (c->hysteresis_min > 100 )) c->hysteresis_min = HYSTERESIS_MIN_DEFAULT;
+    if ((c->hysteresis_max < 0) || (c->hysteresis_max > 100 )) c->hysteresis_max = HYSTERESIS_MAX_DEFAULT;
+    if (c->hysteresis_min >= c->hysteresis_max) {
+        c->hysteresis_min = HYSTERESIS_MIN_DEFAULT;
+        c->hysteresis_max = HYSTERESIS_MAX_DEFAULT;
+    }
+    if ((c->runtime < 1) || (c->runtime > 10)) c->runtime = RUNTIME_DEFAULT;
+    if ((c->tick_ms < 100) || (c->tick_ms > 10000)) c->tick_ms = TICK_DEFAULT;
+    if ((c->stale_timeout < 10) || (c->stale_timeout > 3600)) c->stale_timeout = STALE_TIMEOUT_DEFAULT;
+    if ((c->grid_setpoint < -2000) || (c->grid_setpoint > 5000)) c->grid_setpoint = GRID_SETPOINT_DEFAULT;
+    if ((c->window < 1) || (c->window > SERIES_SIZE)) c->window = WINDOW_DEFAULT;
+    if (c->grid_deadband > 2000) c->grid_deadband = GRID_DEADBAND_DEFAULT;
+    if ((c->min_interval < INTERVAL_FAST) || (c->min_interval > 3600)) c->min_interval = MIN_INTERVAL_DEFAULT;
+    if (c->forecast.minutes > FORECAST_MAX) c->forecast.minutes = FORECAST_MAX;
+    if (c->forecast.minutes && (c->forecast.minutes < FORECAST_STEP)) c->forecast.minutes = FORECAST_STEP;
+    return;
+}
+
+void copy_settings(mqttattr *dst, mqttattr *src) {
+    dst->battery = src->battery;
+    dst->battery_max = src->battery_max;
+    dst->pump = src->pump;
+    dst->hysteresis_min = src->hysteresis_min;
+    dst->hysteresis_max = src->hysteresis_max;
+    dst->target_soc = src->target_soc;
+    dst->reduced = src->reduced;
+    dst->allocation = src->allocation;
+    dst->control = src->control;
+    dst->grid_setpoint = src->grid_setpoint;
+    dst->grid_deadband = src->grid_deadband;
+    dst->smoothing = src->smoothing;
+    dst->window = src->window;
+    dst->min_interval = src->min_interval;
+    dst->forecast.minutes = src->forecast.minutes;
+    dst->runtime = src->runtime;
+    dst->tick_ms = src->tick_ms;
+    dst->stale_timeout = src->stale_timeout;
+    return;
+}
+
+// Reads lines "<name> <value>" with the names of the command line options, with or without "--".
+// Returns 0, -1 if the file cannot be read or the number of the first invalid line.
+int read_config(mqttattr *c, const char *file) {
+    char line[256], *name, *value, *p;
+    FILE *f = fopen(file, "r");
+    int n = 0;
+
+    if (!f) return(-1);
+    while (fgets(line, sizeof(line), f)) {
+        n++;
+        if ((p = strchr(line, '#'))) *p = 0;
+        name = strtok_r(line, " \t\r\n=", &p);
+        if (!name) continue;
+        value = strtok_r(NULL, " \t\r\n=", &p);
+        if (!strncmp(name, "--", 2)) name += 2;
+        if (!parse_setting(c, name, value)) {
+            fclose(f);
+            return(n);
+        }
+    }
+    fclose(f);
+    return(0);
+}
+
+// Sets the settings in the order defaults, config file, command line and checks them.
+// Returns the result of read_config, the settings are only valid if it is 0.
+int load_settings(mqttattr *c) {
+    mqttattr d = create_mqttattr();
+    int i, n, rc = 0;
+
+    copy_settings(c, &d);
+    if (c->config_file) rc = read_config(c, c->config_file);
+    for (i = 1; i < c->argc; i++) {
+        n = strncmp(c->argv[i], "--", 2) ? 0 : parse_setting(c, c->argv[i] + 2, (i + 1 < c->argc) ? c->argv[i + 1] : NULL);
+        if (n) i += n - 1;
+    }
+    check_settings(c);
+    return(rc);
+}
+
+// Takes over reloaded settings between two decisions. The hysteresis state is kept, the grid
+// integrals start anew with another control, watched fields get the new stale timeout and a new
+// target SOC is sent to the cars.
+void apply_settings(mqttattr *mqtta, mqttattr *next) {
+    char buffer[16];
+    int i, f, pump = mqtta->pump;
+
+    if (next->pump == -1) pump = -1;
+    else if (pump == -1) pump = 0;
+    if (next->control != mqtta->control) {
+        for (i = 0; i < mqtta->vehicles; i++) {
+            mqtta->car[i].grid_integral = 0;
+            mqtta->car[i].grid_ts_us = 0;
+        }
+    }
+    if (next->stale_timeout != mqtta->stale_timeout)
+        for (f = 0; f < TOPIC_COUNT; f++)
+            if (mqtta->field_timeout[f]) mqtta->field_timeout[f] = next->stale_timeout;
+    if ((next->target_soc != mqtta->target_soc) && mqtta->session) {
+        sprintf(buffer, "%d", next->target_soc);
+        for (i = 0; i < mqtta->vehicles; i++) publish(mqtta, mqtta->car[i].topic_control_target_soc, buffer);
+    }
+
+    copy_settings(mqtta, next);
+    mqtta->pump = pump;
+    for (i = 0; i < mqtta->vehicles; i++) mqtta->car[i].action = 1;
+    mqtta->dirty = 1;
+    return;
+}
+
+// Called on SIGHUP from the main loop. The connection, the subscriptions and the charging state
+// are not touched, an invalid config file keeps the current settings.
+void reload_config(mqttattr *mqtta) {
+    mqttattr next = create_mqttattr();
+    int rc;
+
+    if (!mqtta->config_file) {
+        log_msg(LOG_INFO, "SIGHUP ignored, there is no config file");
+        return;
+    }
+    next.config_file = mqtta->config_file;
+    next.argc = mqtta->argc;
+    next.argv = mqtta->argv;
+    rc = load_settings(&next);
+    if (rc < 0) log_msg(LOG_ERROR, "Error: config file '%s' could not be read (%s), settings unchanged", mqtta->config_file, strerror(errno));
+    else if (rc) log_msg(LOG_ERROR, "Error: invalid line %d in config file '%s', settings unchanged", rc, mqtta->config_file);
+    if (rc) return;
+
+    apply_settings(mqtta, &next);
+    log_msg(LOG_INFO, "settings reloaded from '%s': battery = %d battery_max = %d hysteresis = %d..%d%s target_soc = %d control = %s",
+        mqtta->config_file, mqtta->battery, mqtta->battery_max, mqtta->hysteresis_min, mqtta->hysteresis_max, (mqtta->pump == -1) ? " (off)" : "",
+        mqtta->target_soc, (mqtta->control == CONTROL_GRID) ? "grid" : "surplus");
+    session_event(mqtta, "config", -1, "reload", 0, mqtta->config_file);
+    return;
+}
+
+void control_tick(mqttattr *mqtta) {
+    if (mqtta->ts_start == 0) mqtta->ts_start = now_s();
+
+    if (mqtta->session && (now_s() > mqtta->ts_start + (3600 * mqtta->runtime)))
+        end_session(mqtta, "runtime has expired");
+
+    if (mqtta->session) retry_commands(mqtta);
+
+    // a burst of messages results in one evaluation
+    if (mqtta->dirty) {
+        mqtta->dirty = 0;
+        if (mqtta->session) {
+            mqtta->evaluations++;
+            evaluate(mqtta);
+        }
+    }
+
+    if (now_us() >= mqtta->status_next_us) {
+        status_line(mqtta);
+        mqtta->status_next_us = now_us() + 1000LL * STATUS_INTERVAL_MS;
+    }
+
+    state_save(mqtta);
+    shared_update(mqtta, 1);
+    return;
+}
+
+// Reduces or stops the charging for every watched field without fresh data and
+// returns the time of the next staleness deadline.
+long long check_stale(mqttattr *mqtta) {
+    long long t = now_us();
+    long long next = t + 1000000LL * mqtta->stale_timeout;
+    long long deadline;
+    int f, i;
+
+    if (!mqtta->session) return(next);
+
+    for (f = 0; f < TOPIC_COUNT; f++) {
+        if (!mqtta->field_timeout[f]) continue;
+        deadline = mqtta->field_seen_us[f] + 1000000LL * mqtta->field_timeout[f];
+        if (deadline <= t) {
+            log_msg(LOG_INFO, "no data from '%s' for %d s", mqtta->topic_name[f], mqtta->field_timeout[f]);
+            mqtta->stale_check = 1;
+            for (i = 0; i < mqtta->vehicles; i++) {
+                vehicle *v = &mqtta->car[i];
+                if ((v->chargingState == STATE_CHARGING) && (v->maxChargeCurrentAC != CURRENT_REDUCED)) {
+                    if (send_command(mqtta, v->topic_control_current, (char*)"reduced"))
+                        log_msg(LOG_INFO, "%spublished: switch to reduced charging power (stale data)", v->label);
+                } else if (v->chargingState == STATE_CHARGING) {
+                    if (send_command(mqtta, v->topic_control_charging, (char*)"stop"))
+                        log_msg(LOG_INFO, "%spublished: stop charging (stale data)", v->label);
+                }
+            }
+            mqtta->stale_check = 0;
+            // escalates from reduced to stop if the data is still missing after the next period
+            mqtta->field_seen_us[f] = t;
+            deadline = t + 1000000LL * mqtta->field_timeout[f];
+        }
+        if (deadline < next) next = deadline;
+    }
+    return(next);
+}
+
+#if defined(__linux__)
+int arm_timer(int fd, long long at_us, long long interval_us) {
+    struct itimerspec its;
+
+    its.it_value.tv_sec = at_us / 1000000;
+    its.it_value.tv_nsec = (at_us % 1000000) * 1000;
+    its.it_interval.tv_sec = interval_us / 1000000;
+    its.it_interval.tv_nsec = (interval_us % 1000000) * 1000;
+    return(timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL));
+}
+
+int add_fd(int efd, int fd, unsigned int events) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    return(epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev));
+}
+
+// Listens on localhost for Prometheus scrapes.
+int metrics_listen(int port) {
+    struct sockaddr_in addr;
+    int fd, on = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return(-1);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 4)) {
+        close(fd);
+        return(-1);
+    }
+    return(fd);
+}
+
+// Answers every connection with the metrics, the request itself is not evaluated. The request is
+// read up to the end of its headers and the rest is drained before the close, an unread request
+// would make the close reset the connection before the client has read the answer.
+void metrics_serve(mqttattr *mqtta, int fd) {
+    struct timeval tv = {0, 1000 * METRICS_TIMEOUT_MS};
+    char request[1024];
+    char buf[STATS_LEN];
+    char head[128];
+    int client, n, len;
+
+    while ((client = accept(fd, NULL, NULL)) >= 0) {
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        len = 0;
+        while ((len < (int)sizeof(request) - 1) && ((n = recv(client, request + len, sizeof(request) - 1 - len, 0)) > 0)) {
+            len += n;
+            request[len] = 0;
+            if (strstr(request, "\r\n\r\n")) break;
+        }
+        n = stats_prometheus(mqtta, buf, sizeof(buf));
+        if (n >= (int)sizeof(buf)) n = sizeof(buf) - 1;
+        snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n", n);
+        if (send(client, head, strlen(head), MSG_NOSIGNAL) > 0) send(client, buf, n, MSG_NOSIGNAL);
+        shutdown(client, SHUT_WR);
+        while (recv(client, request, sizeof(request), 0) > 0);
+        close(client);
+    }
+    return;
+}
+
+// Waits on the broker socket and the timers only, so the process sleeps while nothing is due.
+// The tick fires once a burst of messages has settled, runtime and staleness deadlines fire
+// even if the broker is silent.
+int event_loop(struct mosquitto *mosq, mqttattr *mqtta) {
+    struct epoll_event ev, events[8];
+    int efd, tick_fd, runtime_fd, stale_fd, misc_fd, stats_fd, metrics_fd = -1;
+    int sock = -1, s, n, i, rc, tick_armed = 0, received;
+    long long runtime_end = 0, tick_cap = 0, tick_at;
+    unsigned int sock_events = 0;
+    uint64_t expirations;
+
+    efd = epoll_create1(EPOLL_CLOEXEC);
+    tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    runtime_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    stale_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    misc_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    stats_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if ((efd < 0) || (tick_fd < 0) || (runtime_fd < 0) || (stale_fd < 0) || (misc_fd < 0) || (stats_fd < 0)) {
+        log_msg(LOG_ERROR, "Error: event loop could not be created (%s)", strerror(errno));
+        rc = 1;
+        goto cleanup;
+    }
+
+    add_fd(efd, tick_fd, EPOLLIN);
+    add_fd(efd, runtime_fd, EPOLLIN);
+    add_fd(efd, stale_fd, EPOLLIN);
+    add_fd(efd, misc_fd, EPOLLIN);
+    add_fd(efd, stats_fd, EPOLLIN);
+    if (mqtta->metrics_port) {
+        metrics_fd = metrics_listen(mqtta->metrics_port);
+        if (metrics_fd < 0) log_msg(LOG_ERROR, "Error: metrics port %d could not be opened (%s)", mqtta->metrics_port, strerror(errno));
+        else add_fd(efd, metrics_fd, EPOLLIN);
+    }
+    if (mqtta->threaded) add_fd(efd, mqtta->rx_fd, EPOLLIN);
+
+    mqtta->ts_start = now_s();
+    watch_fields(mqtta);
+    arm_timer(stale_fd, check_stale(mqtta), 0);
+    arm_timer(stats_fd, now_us() + 1000000LL * STATS_INTERVAL, 1000000LL * STATS_INTERVAL);
+    if (!mqtta->threaded) arm_timer(misc_fd, now_us() + 250000LL * KEEPALIVE, 250000LL * KEEPALIVE);
+
+    while (go) {
+        // a new daemon session or a reloaded runtime moves the deadline
+        if (mqtta->session && (1000000LL * (mqtta->ts_start + 3600LL * mqtta->runtime) != runtime_end)) {
+            runtime_end = 1000000LL * (mqtta->ts_start + 3600LL * mqtta->runtime);
+            arm_timer(runtime_fd, runtime_end, 0);
+        }
+
+        // in threaded mode the connection belongs to the network thread
+        s = mqtta->threaded ? -1 : mosquitto_socket(mosq);
+        if (s != sock) {
+            if (sock >= 0) epoll_ctl(efd, EPOLL_CTL_DEL, sock, NULL);
+            sock = s;
+            sock_events = 0;
+            if (sock >= 0) {
+                sock_events = EPOLLIN;
+                add_fd(efd, sock, sock_events);
+            }
+        }
+        if ((sock >= 0) && ((mosquitto_want_write(mosq) ? EPOLLIN | EPOLLOUT : EPOLLIN) != sock_events)) {
+            sock_events = mosquitto_want_write(mosq) ? EPOLLIN | EPOLLOUT : EPOLLIN;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = sock_events;
+            ev.data.fd = sock;
+            epoll_ctl(efd, EPOLL_CTL_MOD, sock, &ev);
+        }
+
+        // without a socket retry the connection once a second
+        n = epoll_wait(efd, events, 8, ((sock < 0) && !mqtta->threaded) ? 1000 : -1);
+        if ((n < 0) && (errno != EINTR)) {
+            log_msg(LOG_ERROR, "Error: epoll_wait (%s)", strerror(errno));
+            break;
+        }
+        if (reload) {
+            reload = 0;
+            reload_config(mqtta);
+        }
+        if ((n <= 0) && (sock < 0) && !mqtta->threaded && go) {
+            mosquitto_reconnect(mosq);
+            continue;
+        }
+
+        received = 0;
+        for (i = 0; i < n; i++) {
+            if (events[i].data.fd == sock) {
+                rc = MOSQ_ERR_SUCCESS;
+                if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                    rc = mosquitto_loop_read(mosq, 1);
+                    received = 1;
+                }
+                if (!rc && (events[i].events & EPOLLOUT)) rc = mosquitto_loop_write(mosq, 1);
+                if (rc && go) {
+                    epoll_ctl(efd, EPOLL_CTL_DEL, sock, NULL);
+                    sock = -1;
+                    usleep(10000);
+                    mosquitto_reconnect(mosq);
+                    break;
+                }
+            } else if (mqtta->threaded && (events[i].data.fd == mqtta->rx_fd)) {
+                sample smp;
+                if (read(mqtta->rx_fd, &expirations, sizeof(expirations)) > 0)
+                    while (ring_pop(&mqtta->rx, &smp)) apply_sample(mqtta, &smp);
+                received = 1;
+            } else if (events[i].data.fd == tick_fd) {
+                if (read(tick_fd, &expirations, sizeof(expirations)) > 0) {
+                    tick_armed = 0;
+                    control_tick(mqtta);
+                }
+            } else if (events[i].data.fd == runtime_fd) {
+                if (read(runtime_fd, &expirations, sizeof(expirations)) > 0)
+                    end_session(mqtta, "runtime has expired");
+            } else if (events[i].data.fd == stale_fd) {
+                if (read(stale_fd, &expirations, sizeof(expirations)) > 0)
+                    arm_timer(stale_fd, check_stale(mqtta), 0);
+            } else if (events[i].data.fd == stats_fd) {
+                if (read(stats_fd, &expirations, sizeof(expirations)) > 0)
+                    publish_stats(mqtta);
+            } else if ((metrics_fd >= 0) && (events[i].data.fd == metrics_fd)) {
+                metrics_serve(mqtta, metrics_fd);
+            } else if (events[i].data.fd == misc_fd) {
+                if (read(misc_fd, &expirations, sizeof(expirations)) > 0)
+                    mosquitto_loop_misc(mosq);
+            }
+        }
+
+        // a burst is evaluated once no message came for TICK_SETTLE_MS, at the latest tick_ms after its first one,
+        // so that the evaluation does not mix the values of two bursts
+        if (mqtta->dirty && (!tick_armed || received)) {
+            if (!tick_armed) tick_cap = now_us() + 1000LL * mqtta->tick_ms;
+            tick_at = now_us() + 1000LL * TICK_SETTLE_MS;
+            arm_timer(tick_fd, (tick_at < tick_cap) ? tick_at : tick_cap, 0);
+            tick_armed = 1;
+        }
+    }
+    rc = 0;
+
+cleanup:
+    if (metrics_fd >= 0) close(metrics_fd);
+    if (stats_fd >= 0) close(stats_fd);
+    if (misc_fd >= 0) close(misc_fd);
+    if (stale_fd >= 0) close(stale_fd);
+    if (runtime_fd >= 0) close(runtime_fd);
+    if (tick_fd >= 0) close(tick_fd);
+    if (efd >= 0) close(efd);
+    return(rc);
+}
+
+// Owns the broker connection in threaded mode. Received samples go to the control thread
+// through the rx ring, commands of the control thread arrive through the tx ring.
+void *network_thread(void *arg) {
+    mqttattr *mqtta = arg;
+    struct mosquitto *mosq = mqtta->mosq;
+    struct pollfd pfd[2];
+    command cmd;
+    uint64_t n;
+    int rc;
+
+    log_producer = 1;
+
+    while (go) {
+        pfd[0].fd = mosquitto_socket(mosq);
+        pfd[0].events = POLLIN | (mosquitto_want_write(mosq) ? POLLOUT : 0);
+        pfd[0].revents = 0;
+        pfd[1].fd = mqtta->tx_fd;
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+
+        if ((poll(pfd, 2, 1000) < 0) && (errno != EINTR)) break;
+
+        if (pfd[0].fd < 0) rc = MOSQ_ERR_NO_CONN;
+        else {
+            rc = MOSQ_ERR_SUCCESS;
+            if (pfd[0].revents & (POLLIN | POLLERR | POLLHUP)) rc = mosquitto_loop_read(mosq, 1);
+            if (!rc && (pfd[0].revents & POLLOUT)) rc = mosquitto_loop_write(mosq, 1);
+            if (!rc) rc = mosquitto_loop_misc(mosq);
+        }
+        if (rc && go) {
+            usleep(10000);
+            mosquitto_reconnect(mosq);
+        }
+
+        if (pfd[1].revents & POLLIN) {
+            if (read(mqtta->tx_fd, &n, sizeof(n)) < 0) n = 0;
+        }
+        while (ring_pop(&mqtta->tx, &cmd)) enqueue_command(mqtta, &cmd);
+        flush_commands(mqtta);
+    }
+    return(NULL);
+}
+
+int start_network_thread(mqttattr *mqtta, pthread_t *thread) {
+    sigset_t old;
+    int rc;
+
+    if (!ring_init(&mqtta->rx, RING_SIZE, sizeof(sample)) || !ring_init(&mqtta->tx, RING_SIZE, sizeof(command))) return(0);
+    mqtta->rx_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    mqtta->tx_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ((mqtta->rx_fd < 0) || (mqtta->tx_fd < 0)) return(0);
+
+    block_signals(&old);
+    mqtta->threaded = 1;
+    rc = pthread_create(thread, NULL, network_thread, mqtta);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc) mqtta->threaded = 0;
+    return(!rc);
+}
+
+void stop_network_thread(mqttattr *mqtta, pthread_t thread) {
+    uint64_t one = 1;
+    command cmd;
+
+    // the event loop may also have returned on an error with go still set
+    go = 0;
+    if (write(mqtta->tx_fd, &one, sizeof(one)) < 0) log_msg(LOG_ERROR, "Error: network thread could not be woken up (%s)", strerror(errno));
+    pthread_join(thread, NULL);
+    mqtta->threaded = 0;
+
+    // take over what the control thread has sent in the meantime
+    while (ring_pop(&mqtta->tx, &cmd)) enqueue_command(mqtta, &cmd);
+    close(mqtta->rx_fd);
+    close(mqtta->tx_fd);
+    mqtta->rx_fd = -1;
+    mqtta->tx_fd = -1;
+    ring_free(&mqtta->rx);
+    ring_free(&mqtta->tx);
+    return;
+}
+#endif
+
+// Feeds a recorded log through the same parsing and control code. The clock follows the
+// recorded time, speed 0 replays as fast as possible.
+int replay(mqttattr *mqtta, char *file, double speed) {
+    FILE *f;
+    unsigned char head[11];
+    char payload[RECORD_PAYLOAD_MAX + 1];
+    struct timespec t0, t1;
+    sample smp[SAMPLES_MAX];
+    long long t, t_first = 0, t_prev = 0, tick_due = 0, tick_cap = 0, stale_next = 0, deadline = 0;
+    double solar = 0, home = 0, grid_in = 0, grid_out = 0, bat_in = 0, bat_out = 0, h, elapsed;
+    long messages = 0;
+    int i, n, len, id, v1;
+
+    f = fopen(file, "rb");
+    if (!f) {
+        printf("Error: could not open '%s'\n", file);
+        return(1);
+    }
+    if (fread(head, 1, strlen(RECORD_MAGIC), f) != strlen(RECORD_MAGIC)) head[0] = 0;
+    v1 = !memcmp(head, RECORD_MAGIC_V1, strlen(RECORD_MAGIC_V1));
+    if (!v1 && memcmp(head, RECORD_MAGIC, strlen(RECORD_MAGIC))) {
+        printf("Error: '%s' is not a chargemanager record\n", file);
+        fclose(f);
+        return(1);
+    }
+
+    mqtta->replay = 1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    while (go && (fread(head, 1, sizeof(head), f) == sizeof(head))) {
+        for (t = 0, i = 7; i >= 0; i--) t = (t << 8) | head[i];
+        len = head[9] | (head[10] << 8);
+        if ((len > RECORD_PAYLOAD_MAX) || (fread(payload, 1, len, f) != (size_t)len)) break;
+        payload[len] = 0;
+        // version 1 had no snapshot field, so the topic ids of the vehicles were 13 apart
+        id = v1 ? TOPIC_ID(head[8] / RECORD_FIELDS_V1, head[8] % RECORD_FIELDS_V1) : head[8];
+        if ((id >= TOPIC_COUNT) || !mqtta->topic_name[id]) continue;
+
+        if (!t_first) {
+            t_first = t_prev = virtual_us = t;
+            mqtta->ts_start = now_s();
+            watch_fields(mqtta);
+            stale_next = t + 1000000LL * mqtta->stale_timeout;
+            deadline = t + 3600000000LL * mqtta->runtime;
+        }
+        if (speed > 0 && t > t_prev) usleep((t - t_prev) / speed);
+
+        // energy of the interval since the previous message
+        h = (t - t_prev) / 3600000000.0;
+        solar += mqtta->pv_solar_power * h;
+        home += mqtta->pv_home_power * h;
+        if (mqtta->pv_grid_power > 0) grid_in += mqtta->pv_grid_power * h; else grid_out -= mqtta->pv_grid_power * h;
+        if (mqtta->pv_battery_power > 0) bat_in += mqtta->pv_battery_power * h; else bat_out -= mqtta->pv_battery_power * h;
+        t_prev = t;
+
+        // run what the event loop would have run until this message
+        if (tick_due && (tick_due <= t)) {
+            virtual_us = tick_due;
+            tick_due = 0;
+            control_tick(mqtta);
+        }
+        while (go && (stale_next <= t)) {
+            virtual_us = stale_next;
+            stale_next = check_stale(mqtta);
+        }
+        if (!mqtta->daemon && (deadline <= t)) {
+            virtual_us = deadline;
+            log_msg(LOG_INFO, "Stop program because runtime has expired.");
+            go = 0;
+            break;
+        }
+        virtual_us = t;
+
+        n = parse_message(id, payload, len, smp);
+        for (i = 0; i < n; i++) apply_sample(mqtta, &smp[i]);
+        messages++;
+
+        // settles like the tick of the event loop
+        if (mqtta->dirty) {
+            if (!tick_due) tick_cap = t + 1000LL * mqtta->tick_ms;
+            tick_due = (t + 1000LL * TICK_SETTLE_MS < tick_cap) ? t + 1000LL * TICK_SETTLE_MS : tick_cap;
+        }
+    }
+    if (go && tick_due) {
+        virtual_us = tick_due;
+        control_tick(mqtta);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    fclose(f);
+    virtual_us = 0;
+
+    printf("replay: %ld messages, %.0f s recorded, replayed in %.3f s\n", messages, (t_prev - t_first) / 1e6, elapsed);
+    printf("replay: %ld commands, %ld evaluations\n", mqtta->replay_commands, mqtta->evaluations);
+    print_command_stats(mqtta);
+    printf("replay: %ld charge cycles", charge_cycles(mqtta));
+    if (mqtta->forecast.minutes) printf(", forecast held %ld starts and %ld stops", mqtta->forecast.held_starts, mqtta->forecast.held_stops);
+    printf("\n");
+    printf("replay: solar=%.2f kWh home=%.2f kWh grid_import=%.2f kWh grid_export=%.2f kWh battery_charge=%.2f kWh battery_discharge=%.2f kWh\n",
+        solar / 1000, home / 1000, grid_in / 1000, grid_out / 1000, bat_in / 1000, bat_out / 1000);
+    return(0);
+}
+
+long long mono_us() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return((x > y) - (x < y));
+}
+
+// Messages per second through topic lookup, parsing, the state update and the decision, on a
+// synthetic day with five site values per second and a change of the charging state every five
+// minutes. Runs on the virtual clock like a replay, commands are only counted.
+int bench_decision(mqttattr *mqtta, long count) {
+    static char payload[BENCH_SECONDS][5][12];
+    static struct mosquitto_message message[BENCH_SECONDS][5];
+    struct mosquitto_message state;
+    long long t0, t1, tick_ns = 0, start_us = 1760680800000000LL;
+    long k, s = 0;
+    int i, j, solar, home;
+
+    for (i = 0; i < BENCH_SECONDS; i++) {
+        solar = 3000 + (i * 37) % 6000;
+        home = 500 + (i * 13) % 400;
+        snprintf(payload[i][0], 12, "%d", home);
+        snprintf(payload[i][1], 12, "%d", home - solar);
+        snprintf(payload[i][2], 12, "%d", 0);
+        snprintf(payload[i][3], 12, "%d", 50);
+        snprintf(payload[i][4], 12, "%d", solar);
+        for (j = 0; j < 5; j++) {
+            message[i][j].topic = mqtta->topic_name[(j == 4) ? FIELD_SOLAR_POWER : FIELD_HOME_POWER + j];
+            message[i][j].payload = payload[i][j];
+            message[i][j].payloadlen = strlen(payload[i][j]);
+            message[i][j].qos = 0;
+            message[i][j].retain = false;
+            message[i][j].mid = 0;
+        }
+    }
+    memset(&state, 0, sizeof(state));
+    state.topic = mqtta->topic_name[TOPIC_ID(0, FIELD_CHARGING_STATE)];
+
+    mqtta->replay = 1;
+    virtual_us = start_us;
+    mqtta->ts_start = now_s();
+    watch_fields(mqtta);
+
+    t0 = mono_us();
+    for (k = 0; k < count; k++) {
+        message_callback(NULL, mqtta, &message[s % BENCH_SECONDS][k % 5]);
+        if (k % 5 < 4) continue;
+
+        // one second is complete
+        s++;
+        if (s % 300 == 0) {
+            state.payload = (void*)state_name[((s / 300) % 2) ? STATE_CHARGING : STATE_READY_FOR_CHARGING];
+            state.payloadlen = strlen(state.payload);
+            message_callback(NULL, mqtta, &state);
+        }
+        virtual_us = start_us + 1000000LL * s;
+        // consecutive runs of the program, no evaluation may fall behind the end of the runtime
+        if (s % (3600 * mqtta->runtime) == 0) mqtta->ts_start = now_s();
+        t1 = mono_us();
+        control_tick(mqtta);
+        tick_ns += 1000 * (mono_us() - t1);
+    }
+    t1 = mono_us();
+    virtual_us = 0;
+
+    printf("{\"benchmark\":\"decision\",\"messages\":%ld,\"evaluations\":%ld,\"commands\":%ld,\"seconds\":%.3f,", count, mqtta->evaluations, mqtta->replay_commands, (t1 - t0) / 1e6);
+    printf("\"messages_per_second\":%.0f,\"ns_per_message\":%.1f,\"ns_per_evaluation\":%.1f}\n",
+        count / ((t1 - t0) / 1e6), 1000.0 * (t1 - t0) / count, mqtta->evaluations ? (double)tick_ns / mqtta->evaluations : 0.0);
+    return(0);
+}
+
+void bench_publish(bench *b, char *topic, const char *payload) {
+    mosquitto_publish(b->mosq, NULL, topic, strlen(payload), payload, 0, false);
+    return;
+}
+
+// Publishes the site values window times, so that the smoothed values follow at once.
+void bench_site(bench *b, int solar, int home) {
+    mqttattr *mqtta = b->mqtta;
+    char payload[160];
+    int i;
+
+    for (i = 0; i < mqtta->window; i++) {
+        if (mqtta->snapshot) {
+            snprintf(payload, sizeof(payload), "{\"solar\":{\"power\":%d},\"home\":{\"power\":%d},\"grid\":{\"power\":%d},\"battery\":{\"power\":0,\"soc\":50}}", solar, home, home - solar);
+            bench_publish(b, mqtta->snapshot, payload);
+            continue;
+        }
+        snprintf(payload, sizeof(payload), "%d", home);
+        bench_publish(b, mqtta->topic_name[FIELD_HOME_POWER], payload);
+        snprintf(payload, sizeof(payload), "%d", home - solar);
+        bench_publish(b, mqtta->topic_name[FIELD_GRID_POWER], payload);
+        snprintf(payload, sizeof(payload), "%d", solar);
+        bench_publish(b, mqtta->topic_name[FIELD_SOLAR_POWER], payload);
+    }
+    if (!mqtta->snapshot) {
+        bench_publish(b, mqtta->topic_name[FIELD_BATTERY_POWER], "0");
+        bench_publish(b, mqtta->topic_name[FIELD_BATTERY_SOC], "50");
+    }
+    return;
+}
+
+void bench_message_callback(struct mosquitto *mosq, void *obj, const struct mosquitto_message *message) {
+    bench *b = obj;
+
+    atomic_store(&b->command_us, mono_us());
+    return;
+}
+
+// Alternates a large surplus and a deficit after a quiet period that is longer than the pacing of
+// the control and measures the time from the last site value to the start or stop command.
+void *bench_thread(void *arg) {
+    bench *b = arg;
+    mqttattr *mqtta = b->mqtta;
+    int quiet = ((mqtta->control == CONTROL_GRID) ? mqtta->min_interval : INTERVAL_FAST) + 1;
+    long long t0, t;
+    int round;
+
+    log_producer = 2;
+    sleep(2);
+    bench_publish(b, mqtta->topic_name[TOPIC_ID(0, FIELD_PLUG_CONNECTION)], "connected");
+    bench_publish(b, mqtta->topic_name[TOPIC_ID(0, FIELD_ODOMETER)], "1000");
+    bench_publish(b, mqtta->topic_name[TOPIC_ID(0, FIELD_MAX_CHARGE_CURRENT)], mqtta->reduced ? "reduced" : "maximum");
+    bench_publish(b, mqtta->topic_name[TOPIC_ID(0, FIELD_CHARGING_STATE)], "readyForCharging");
+    bench_site(b, 1000, 1000);
+
+    for (round = 0; go && (round < b->rounds); round++) {
+        sleep(quiet);
+        if (!go) break;
+        atomic_store(&b->command_us, 0);
+        if (round % 2) bench_site(b, 200, 3500 + 2 * REDUCED_CHARGE_POWER);
+        else bench_site(b, 3 * REDUCED_CHARGE_POWER, 500);
+        t0 = mono_us();
+        while (go && !atomic_load(&b->command_us) && (mono_us() - t0 < 1000000LL * BENCH_TIMEOUT)) usleep(1000);
+        t = atomic_load(&b->command_us);
+        if (t) b->latency_ms[b->received++] = (t - t0) / 1000.0;
+        else log_msg(LOG_ERROR, "bench: round %d without command", round);
+
+        // WeConnect confirms the command
+        if (round % 2) bench_publish(b, mqtta->topic_name[TOPIC_ID(0, FIELD_CHARGING_STATE)], "readyForCharging");
+        else {
+            bench_publish(b, mqtta->topic_name[TOPIC_ID(0, FIELD_CHARGING_STATE)], "charging");
+            bench_publish(b, mqtta->topic_name[TOPIC_ID(0, FIELD_MAX_CHARGE_CURRENT)], "reduced");
+        }
+    }
+
+    // the last message wakes the control thread up
+    go = 0;
+    bench_publish(b, mqtta->topic_name[TOPIC_ID(0, FIELD_ODOMETER)], "1000");
+    return(NULL);
+}
+
+// Starts the synthetic publishers on a second connection to the broker.
+int bench_start(mqttattr *mqtta, bench *b) {
+    sigset_t old;
+    char cid[32];
+    int rc;
+
+    b->mqtta = mqtta;
+    b->received = 0;
+    atomic_init(&b->command_us, 0);
+    snprintf(cid, sizeof(cid), "charger/bench/%d", getpid());
+    b->mosq = mosquitto_new(cid, true, b);
+    if (!b->mosq) return(0);
+    mosquitto_message_callback_set(b->mosq, bench_message_callback);
+    if (mqtta->mqtt_user && mqtta->mqtt_password) mosquitto_username_pw_set(b->mosq, mqtta->mqtt_user, mqtta->mqtt_password);
+    // the loop thread of the library and the benchmark thread leave the signals to the control thread
+    block_signals(&old);
+    rc = mosquitto_connect(b->mosq, mqtta->mqtt_host, mqtta->mqtt_port, KEEPALIVE) || mosquitto_loop_start(b->mosq);
+    if (!rc) {
+        mosquitto_subscribe(b->mosq, NULL, mqtta->car[0].topic_control_charging, 0);
+        rc = pthread_create(&b->thread, NULL, bench_thread, b);
+        if (rc) {
+            mosquitto_disconnect(b->mosq);
+            mosquitto_loop_stop(b->mosq, true);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc) {
+        mosquitto_destroy(b->mosq);
+        return(0);
+    }
+    return(1);
+}
+
+void bench_stop(bench *b) {
+    double sum = 0;
+    int i;
+
+    pthread_join(b->thread, NULL);
+    mosquitto_disconnect(b->mosq);
+    mosquitto_loop_stop(b->mosq, false);
+    mosquitto_destroy(b->mosq);
+
+    qsort(b->latency_ms, b->received, sizeof(double), compare_double);
+    for (i = 0; i < b->received; i++) sum += b->latency_ms[i];
+    printf("{\"benchmark\":\"e2e\",\"rounds\":%d,\"commands\":%d,\"tick_ms\":%d", b->rounds, b->received, b->mqtta->tick_ms);
+    if (b->received)
+        printf(",\"latency_ms\":{\"min\":%.2f,\"avg\":%.2f,\"p50\":%.2f,\"p95\":%.2f,\"max\":%.2f}", b->latency_ms[0], sum / b->received,
+            b->latency_ms[b->received / 2], b->latency_ms[(95 * b->received + 99) / 100 - 1], b->latency_ms[b->received - 1]);
+    printf("}\n");
+    return;
+}
+
+int main(int argc, char **argv) {
+    struct mosquitto *mosq;
+    int rc = 0;
+    int i = 0, n, vins_dropped = 0;
+    char buffer[16];
+    char *record_file = NULL;
+    char *replay_file = NULL;
+    char *state_file = NULL;
+    char *shared_name = NULL;
+    char *log_file = NULL;
+    char *source_name = (char*)SOURCE_DEFAULT;
+    char *api_name = (char*)VEHICLE_BACKEND_DEFAULT;
+    int log_level = LOG_INFO;
+    int log_size = LOG_SIZE_DEFAULT;
+    int bench_mode = BENCH_NONE;
+    long bench_count = 0;
+    bench b;
+    double speed = 0;
+
+    if ((signal(SIGINT, catch_signal) == SIG_ERR) || (signal(SIGHUP, catch_reload) == SIG_ERR)) {
+        printf("error: signal couldn't be set.\n");
+        exit(0);
+    }
+
+    mqttattr mqtta = create_mqttattr();
+
+    while (i < argc) {
+        n = strncmp(argv[i], "--", 2) ? 0 : parse_setting(&mqtta, argv[i] + 2, (i + 1 < argc) ? argv[i + 1] : NULL);
+        if (n) i += n - 1;
+        if ((!strcmp(argv[i], "--config")) && (i + 1 < argc)) mqtta.config_file = argv[++i];
+        if ((!strcmp(argv[i], "--host")) && (i + 1 < argc)) mqtta.mqtt_host = argv[++i];
+        if ((!strcmp(argv[i], "--port")) && (i + 1 < argc)) mqtta.mqtt_port = atoi(argv[++i]);
+        if ((!strcmp(argv[i], "--user")) && (i + 1 < argc)) mqtta.mqtt_user = argv[++i];
+        if ((!strcmp(argv[i], "--password")) && (i + 1 < argc)) mqtta.mqtt_password = argv[++i];
+        if ((!strcmp(argv[i], "--qos")) && (i + 1 < argc)) mqtta.qos = atoi(argv[++i]);
+        if ((!strcmp(argv[i], "--retain")) && (i + 1 < argc)) mqtta.retain = atoi(argv[++i]);
+        if ((!strcmp(argv[i], "--vin")) && (i + 1 < argc)) {
+            i++;
+            if (mqtta.vehicles < VEHICLES_MAX) {
+                strncpy(mqtta.car[mqtta.vehicles].vin, argv[i], 17);
+                mqtta.car[mqtta.vehicles].vin[17] = 0;
+                if (strlen(argv[i]) > 17) mqtta.car[mqtta.vehicles].vin[0] = 0;
+                mqtta.vehicles++;
+            } else vins_dropped++;
+        }
+        if ((!strcmp(argv[i], "--prefix")) && (i + 1 < argc)) mqtta.prefix = argv[++i];
+        if ((!strcmp(argv[i], "--source")) && (i + 1 < argc)) source_name = argv[++i];
+        if ((!strcmp(argv[i], "--source_prefix")) && (i + 1 < argc)) mqtta.source_prefix = argv[++i];
+        if ((!strcmp(argv[i], "--vehicle_backend")) && (i + 1 < argc)) api_name = argv[++i];
+        if (!strcmp(argv[i], "--threaded")) mqtta.threaded = 1;
+        if (!strcmp(argv[i], "--daemon")) mqtta.daemon = 1;
+        if ((!strcmp(argv[i], "--snapshot")) && (i + 1 < argc)) mqtta.snapshot = argv[++i];
+        if ((!strcmp(argv[i], "--state_file")) && (i + 1 < argc)) state_file = argv[++i];
+        if ((!strcmp(argv[i], "--shm")) && (i + 1 < argc)) shared_name = argv[++i];
+        if ((!strcmp(argv[i], "--metrics_port")) && (i + 1 < argc)) mqtta.metrics_port = abs(atoi(argv[++i]));
+        if ((!strcmp(argv[i], "--record")) && (i + 1 < argc)) record_file = argv[++i];
+        if ((!strcmp(argv[i], "--replay")) && (i + 1 < argc)) replay_file = argv[++i];
+        if ((!strcmp(argv[i], "--speed")) && (i + 1 < argc)) speed = atof(argv[++i]);
+        if (!strcmp(argv[i], "-v")) mqtta.verbose = 1;
+        if ((!strcmp(argv[i], "--log_file")) && (i + 1 < argc)) log_file = argv[++i];
+        if ((!strcmp(argv[i], "--log_size")) && (i + 1 < argc)) log_size = abs(atoi(argv[++i]));
+        if ((!strcmp(argv[i], "--log_level")) && (i + 1 < argc)) {
+            i++;
+            if (!strcmp(argv[i], "error")) log_level = LOG_ERROR;
+            else if (!strcmp(argv[i], "debug")) log_level = LOG_DEBUG;
+            else log_level = LOG_INFO;
+        }
+        if ((!strcmp(argv[i], "--session_log")) && (i + 1 < argc)) mqtta.session_prefix = argv[++i];
+        if ((!strcmp(argv[i], "--bench")) && (i + 1 < argc)) bench_mode = strcmp(argv[++i], "e2e") ? BENCH_DECISION : BENCH_E2E;
+        if ((!strcmp(argv[i], "--bench_count")) && (i + 1 < argc)) bench_count = labs(atol(argv[++i]));
+        i++;
+    }
+
+    if (!mqtta.mqtt_host) mqtta.mqtt_host = localhost;
+    mqtta.source = find_backend(source_backend, sizeof(source_backend) / sizeof(backend), source_name);
+    if (!mqtta.source) {
+        printf("Error: unknown source '%s', using %s\n", source_name, SOURCE_DEFAULT);
+        mqtta.source = find_backend(source_backend, sizeof(source_backend) / sizeof(backend), SOURCE_DEFAULT);
+    }
+    mqtta.api = find_backend(vehicle_backend, sizeof(vehicle_backend) / sizeof(backend), api_name);
+    if (!mqtta.api) {
+        printf("Error: unknown vehicle backend '%s', using %s\n", api_name, VEHICLE_BACKEND_DEFAULT);
+        mqtta.api = find_backend(vehicle_backend, sizeof(vehicle_backend) / sizeof(backend), VEHICLE_BACKEND_DEFAULT);
+    }
+    if (!mqtta.source || !mqtta.api) return(1);
+    select_decoders(&mqtta);
+    if (!mqtta.prefix) mqtta.prefix = (char*)mqtta.api->prefix;
+    if (!mqtta.source_prefix) mqtta.source_prefix = (char*)mqtta.source->prefix;
+    if ((mqtta.qos < 0) || (mqtta.qos > 2)) mqtta.qos = 0;
+    if (mqtta.metrics_port > 65535) mqtta.metrics_port = 0;
+    mqtta.argc = argc;
+    mqtta.argv = argv;
+    rc = load_settings(&mqtta);
+    if (rc < 0) printf("Error: config file '%s' could not be read\n", mqtta.config_file);
+    else if (rc) printf("Error: invalid line %d in config file '%s'\n", rc, mqtta.config_file);
+    if (rc) return(1);
+
+    if (speed < 0) speed = 0;
+    if ((log_size < 1) || (log_size > 1000)) log_size = LOG_SIZE_DEFAULT;
+    if (mqtta.verbose) log_level = LOG_DEBUG;
+    if (log_level == LOG_DEBUG) mqtta.verbose = 1;
+    if (!mqtta.vehicles && replay_file) mqtta.vehicles = 1;
+    if (!mqtta.vehicles && bench_mode) strcpy(mqtta.car[mqtta.vehicles++].vin, "WVWZZZBENCHMARK00");
+    if (bench_mode == BENCH_DECISION) {
+        if ((bench_count < 1000) || (bench_count > 1000000000)) bench_count = BENCH_MESSAGES_DEFAULT;
+        if (log_level == LOG_INFO) log_level = LOG_ERROR;
+    }
+    if (bench_mode == BENCH_E2E) {
+        if ((bench_count < 2) || (bench_count > 64)) bench_count = BENCH_ROUNDS_DEFAULT;
+        b.rounds = bench_count;
+    }
+
+    for (i = 0; i < mqtta.vehicles; i++) {
+        if (strlen(mqtta.car[i].vin) != 17) rc = 1;
+        mqtta.car[i].targetSOC_pct = mqtta.target_soc;
+        if (mqtta.vehicles > 1) sprintf(mqtta.car[i].label, "%s: ", mqtta.car[i].vin);
+    }
+
+    if (((!mqtta.vehicles || rc) && !replay_file) || vins_dropped) {
         printf("chargemanager - charging an electric car depending on the availability of surplus energy from the photovoltaic\n\nusage: %s\n", basename(argv[0]));
-        printf("\t\t\t--vin <vin> vehicle identification number\n");
+        printf("\t\t\t--vin <vin> vehicle identification number, repeat for up to %d cars\n", VEHICLES_MAX);
+        printf("\t\t\t--config <file> read the settings from lines \"<option> <value>\" without \"--\", they are reloaded on SIGHUP, options on the command line take precedence\n");
         printf("\t\t\t--runtime <1..10> program is terminated when the runtime has expired (specified in hours) (default: %d)\n", RUNTIME_DEFAULT);
         printf("\t\t\t--host <host> of the MQTT broker (default: %s)\n", localhost);
         printf("\t\t\t--port <port> of the MQTT broker (default: 1883)\n");
@@ -426,38 +3539,134 @@ int main(int argc, char **argv) {
         printf("\t\t\t--hysteresis_min <0..100> house battery supports car charging min SOC value (default: %d)\n", HYSTERESIS_MIN_DEFAULT);
         printf("\t\t\t--hysteresis_min <0..100> house battery supports car charging max SOC value (default: %d)\n", HYSTERESIS_MAX_DEFAULT);
         printf("\t\t\t--no_hysteresis no support by the house battery\n");
-        printf("\t\t\t--prefix <prefix of the WeConnect topics> (default: %s)\n", weconnect);
+        printf("\t\t\t--prefix <prefix of the vehicle topics> (default: weconnect)\n");
+        printf("\t\t\t--vehicle_backend <weconnect> bridge that publishes the vehicle data (default: %s)\n", VEHICLE_BACKEND_DEFAULT);
+        printf("\t\t\t--source <e3dc,openwb> energy source of the solar, home, grid and battery values (default: %s)\n", SOURCE_DEFAULT);
+        printf("\t\t\t--source_prefix <prefix of the source topics> (default: e3dc or openWB)\n");
         printf("\t\t\t--target_soc <30,40,50,..,100> target SOC of the car battery (default: %d)\n", TARGET_SOC_DEFAULT);
         printf("\t\t\t--reduced charge with reduced power\n");
-        printf("\t\t\t-v verbose mode\n");
+        printf("\t\t\t--allocation <priority,soc,fair> share the surplus by --vin order, lowest SOC first or equally (default: priority)\n");
+        printf("\t\t\t--tick <100..10000> longest delay of the control evaluation after a message in ms, a burst is evaluated %d ms after its last message (default: %d)\n", TICK_SETTLE_MS, TICK_DEFAULT);
+        printf("\t\t\t--stale <10..3600> reduce or stop charging if no solar or home power is received (in s) (default: %d)\n", STALE_TIMEOUT_DEFAULT);
+        printf("\t\t\t--smoothing <none,ewma,mean,median> filter of the power values the control decides on (default: median)\n");
+        printf("\t\t\t--window <1..%d> number of values the filter uses (default: %d)\n", SERIES_SIZE, WINDOW_DEFAULT);
+        printf("\t\t\t--control <surplus,grid> estimate the surplus or regulate the measured grid power (default: surplus)\n");
+        printf("\t\t\t--grid_setpoint <-2000..5000> grid export in W the grid control aims at (default: %d)\n", GRID_SETPOINT_DEFAULT);
+        printf("\t\t\t--grid_deadband <0..2000> deviation in W the grid control ignores (default: %d)\n", GRID_DEADBAND_DEFAULT);
+        printf("\t\t\t--min_interval <10..3600> minimum time between two commands of the grid control in s (default: %d)\n", MIN_INTERVAL_DEFAULT);
+        printf("\t\t\t--forecast <0,%d..%d> hold starts and stops unless the surplus history predicts them for the next minutes (default: 0 = off)\n", FORECAST_STEP, FORECAST_MAX);
+        printf("\t\t\t--snapshot <topic> read the solar, home, grid and battery values from one JSON message instead of the e3dc topics\n");
+        printf("\t\t\t--daemon keep running after a session has ended and start the next one at plug-in or sunrise\n");
+        printf("\t\t\t--state_file <file> keep the control state in a memory mapped file for a fast restart (default with --daemon: %s)\n", STATE_FILE_DEFAULT);
+        printf("\t\t\t--shm <name> export the current state read-only to the shared memory /dev/shm/<name> (default: off)\n");
+        printf("\t\t\t--threaded receive and publish in a separate network thread (Linux only)\n");
+        printf("\t\t\t--metrics_port <port> serve Prometheus metrics on localhost (Linux only) (default: off)\n");
+        printf("\t\t\t--record <file> append all received messages to a binary log\n");
+        printf("\t\t\t--replay <file> run the control on a recorded log without a broker, the VIN is optional\n");
+        printf("\t\t\t--speed <N>x replay speed relative to the recording (default: as fast as possible)\n");
+        printf("\t\t\t--log_file <file> write the log to a file instead of the console, the status line is omitted\n");
+        printf("\t\t\t--log_size <1..1000> size in MB at which the log file is moved to <file>.1 (default: %d)\n", LOG_SIZE_DEFAULT);
+        printf("\t\t\t--log_level <error,info,debug> (default: info)\n");
+        printf("\t\t\t--session_log <prefix> write samples, decisions and commands of each session to <prefix>-<time>.csv\n");
+        printf("\t\t\t--bench <decision,e2e> print messages per second of parsing and decision, or the command latency through the broker, as JSON\n");
+        printf("\t\t\t--bench_count <N> messages of the decision benchmark (default: %d) or rounds of the e2e benchmark (default: %d)\n", BENCH_MESSAGES_DEFAULT, BENCH_ROUNDS_DEFAULT);
+        printf("\t\t\t-v verbose mode, same as --log_level debug\n");
         printf("\nExample: %s --host localhost --vin WVXZZZ12345678900 --no_hysteresis --prefix weconnect\n", basename(argv[0]));
-        printf("\nError: VIN must have 17 characters\n");
+        if (vins_dropped) printf("\nError: at most %d VINs are supported\n", VEHICLES_MAX);
+        else printf("\nError: VIN must have 17 characters\n");
         return(1);
     }
+    rc = 0;
 
     printf("chargemanager: battery_max = %d ", mqtta.battery_max);
     if (mqtta.pump == -1) printf("hysteresis = off "); else printf("hysteresis_min = %d hysteresis_max = %d ", mqtta.hysteresis_min, mqtta.hysteresis_max);
-    printf("runtime = %d target_soc = %d\n", mqtta.runtime, mqtta.targetSOC_pct);
+    printf("runtime = %d target_soc = %d tick = %d ", mqtta.runtime, mqtta.target_soc, mqtta.tick_ms);
+    if (mqtta.control == CONTROL_GRID) printf("control = grid setpoint = %d deadband = %d min_interval = %d\n", mqtta.grid_setpoint, mqtta.grid_deadband, mqtta.min_interval);
+    else printf("control = surplus\n");
+    printf("chargemanager: source = %s (%s) vehicle_backend = %s (%s)\n", mqtta.source->name, mqtta.source_prefix, mqtta.api->name, mqtta.prefix);
+    if (mqtta.forecast.minutes) printf("chargemanager: forecast = %d min\n", mqtta.forecast.minutes);
+    if (mqtta.vehicles > 1) printf("chargemanager: %d vehicles allocation = %s\n", mqtta.vehicles,
+        (mqtta.allocation == ALLOCATION_FAIR) ? "fair" : (mqtta.allocation == ALLOCATION_SOC) ? "soc" : "priority");
 
     sprintf(mqtta.cid, "charger/%d", getpid());
 
-    mstrcpy(&mqtta.topic_control_current, "%s/vehicles/%s/domains/charging/chargingSettings/maxChargeCurrentAC_writetopic", mqtta.prefix, mqtta.vin);
-    mstrcpy(&mqtta.topic_control_charging, "%s/vehicles/%s/controls/charging_writetopic", mqtta.prefix, mqtta.vin);
-    mstrcpy(&mqtta.topic_control_update_interval, "%s/mqtt/weconnectUpdateInterval_s_writetopic", mqtta.prefix);
-    mstrcpy(&mqtta.topic_control_target_soc, "%s/vehicles/%s/domains/charging/chargingSettings/targetSOC_pct_writetopic", mqtta.prefix, mqtta.vin);
+    if (!add_field_topics(&mqtta)) {
+        printf("Error: topics could not be created\n");
+        destroy_mqttattr(&mqtta);
+        return(1);
+    }
 
-    mosquitto_lib_init();
+    for (i = 0; i < mqtta.vehicles; i++) {
+        vehicle *v = &mqtta.car[i];
+        if (mqtta.api->write[WRITE_CURRENT]) mstrcpy(&v->topic_control_current, mqtta.api->write[WRITE_CURRENT], mqtta.prefix, v->vin);
+        if (mqtta.api->write[WRITE_CHARGING]) mstrcpy(&v->topic_control_charging, mqtta.api->write[WRITE_CHARGING], mqtta.prefix, v->vin);
+        if (mqtta.api->write[WRITE_TARGET_SOC]) mstrcpy(&v->topic_control_target_soc, mqtta.api->write[WRITE_TARGET_SOC], mqtta.prefix, v->vin);
+    }
+    if (mqtta.api->write[WRITE_UPDATE_INTERVAL]) mstrcpy(&mqtta.topic_control_update_interval, mqtta.api->write[WRITE_UPDATE_INTERVAL], mqtta.prefix, mqtta.car[0].vin);
+    mstrcpy(&mqtta.topic_stats, "chargemanager/%s/stats", mqtta.car[0].vin);
+
+    if (bench_mode == BENCH_DECISION) {
+        log_start(log_level, log_file, log_size, 0);
+        rc = bench_decision(&mqtta, bench_count);
+        log_stop();
+        destroy_mqttattr(&mqtta);
+        return(rc);
+    }
 
-    sprintf(buffer, "%d", INTERVAL_FAST);
-    publish(mqtta.cid, mqtta.mqtt_host, mqtta.mqtt_port, mqtta.topic_control_update_interval, buffer, mqtta.qos, mqtta.retain, mqtta.verbose, mqtta.mqtt_user, mqtta.mqtt_password);
+    // a replay with --speed can feed a dashboard as well
+    if (shared_name && !shared_open(&mqtta, shared_name)) printf("Error: could not create shared memory '%s', continue without\n", shared_name);
+
+    if (replay_file) {
+        log_start(log_level, log_file, log_size, 0);
+        session_open(&mqtta);
+        rc = replay(&mqtta, replay_file, speed);
+        session_close(&mqtta);
+        shared_close(&mqtta);
+        log_stop();
+        destroy_mqttattr(&mqtta);
+        return(rc);
+    }
 
-    sprintf(buffer, "%d", mqtta.targetSOC_pct);
-    publish(mqtta.cid, mqtta.mqtt_host, mqtta.mqtt_port, mqtta.topic_control_target_soc, buffer, mqtta.qos, mqtta.retain, mqtta.verbose, mqtta.mqtt_user, mqtta.mqtt_password);
+    if (record_file) {
+        mqtta.record = fopen(record_file, "a+b");
+        if (!mqtta.record) {
+            printf("Error: could not open '%s'\n", record_file);
+            destroy_mqttattr(&mqtta);
+            return(1);
+        }
+        // records are only appended to a log of the same version
+        fseek(mqtta.record, 0, SEEK_END);
+        if (ftell(mqtta.record) == 0) fwrite(RECORD_MAGIC, 1, strlen(RECORD_MAGIC), mqtta.record);
+        else {
+            rewind(mqtta.record);
+            if ((fread(buffer, 1, strlen(RECORD_MAGIC), mqtta.record) != strlen(RECORD_MAGIC)) || memcmp(buffer, RECORD_MAGIC, strlen(RECORD_MAGIC))) {
+                printf("Error: '%s' is not a chargemanager record of this version\n", record_file);
+                fclose(mqtta.record);
+                destroy_mqttattr(&mqtta);
+                return(1);
+            }
+        }
+    }
+
+    if (mqtta.daemon && !state_file) state_file = (char*)STATE_FILE_DEFAULT;
+    if (state_file) {
+        if (!state_open(&mqtta, state_file)) printf("Error: could not map state file '%s', continue without\n", state_file);
+        else if ((i = state_restore(&mqtta))) printf("chargemanager: state of %d vehicle(s) restored from '%s'\n", i, state_file);
+    }
+    if (mqtta.daemon) printf("chargemanager: daemon mode, runtime is per session\n");
+
+    if (!log_start(log_level, log_file, log_size, 1)) printf("Error: logging thread could not be started, continue without\n");
+    session_open(&mqtta);
+
+    mosquitto_lib_init();
 
     mosq = mosquitto_new(mqtta.cid, true, &mqtta);
 
     if (mosq) {
+        mqtta.mosq = mosq;
         mosquitto_connect_callback_set(mosq, connect_callback);
+        mosquitto_disconnect_callback_set(mosq, disconnect_callback);
+        mosquitto_publish_callback_set(mosq, publish_callback);
         mosquitto_message_callback_set(mosq, message_callback);
 
         if (mqtta.verbose) {
@@ -467,32 +3676,109 @@ int main(int argc, char **argv) {
             printf("Connecting (%s) to %s:%d with qos=%d\n", mqtta.cid, mqtta.mqtt_host, mqtta.mqtt_port, mqtta.qos);
         }
 
+        // queued until the connection is established
+        sprintf(buffer, "%d", INTERVAL_FAST);
+        publish(&mqtta, mqtta.topic_control_update_interval, buffer);
+
+        sprintf(buffer, "%d", mqtta.target_soc);
+        for (i = 0; i < mqtta.vehicles; i++) publish(&mqtta, mqtta.car[i].topic_control_target_soc, buffer);
+
         if (mqtta.mqtt_user && mqtta.mqtt_password) mosquitto_username_pw_set(mosq, mqtta.mqtt_user, mqtta.mqtt_password);
-        rc = mosquitto_connect(mosq, mqtta.mqtt_host, mqtta.mqtt_port, 60);
+        rc = mosquitto_connect(mosq, mqtta.mqtt_host, mqtta.mqtt_port, KEEPALIVE);
+        // without a broker the benchmark is skipped and reported as such
+        if ((bench_mode == BENCH_E2E) && (rc || !bench_start(&mqtta, &b))) {
+            printf("{\"benchmark\":\"e2e\",\"skipped\":\"no broker at %s:%d\"}\n", mqtta.mqtt_host, mqtta.mqtt_port);
+            bench_mode = BENCH_NONE;
+            go = 0;
+        }
         if (!rc) {
+#if defined(__linux__)
+            pthread_t thread;
+
+            if (mqtta.threaded && !start_network_thread(&mqtta, &thread)) {
+                printf("Error: network thread could not be started, continue single threaded\n");
+                mqtta.threaded = 0;
+            }
+            if (mqtta.threaded) {
+                event_loop(mosq, &mqtta);
+                stop_network_thread(&mqtta, thread);
+            } else event_loop(mosq, &mqtta);
+#else
+            long long tick_next = now_us() + 1000LL * mqtta.tick_ms;
+            long long stale_next;
+            long long stats_next = now_us() + 1000000LL * STATS_INTERVAL;
+
+            watch_fields(&mqtta);
+            stale_next = now_us() + 1000000LL * mqtta.stale_timeout;
             while (go) {
-                rc =  mosquitto_loop(mosq, -1, 1);
+                long long wait = (tick_next - now_us()) / 1000;
+                if (wait < 0) wait = 0;
+                rc = mosquitto_loop(mosq, (int)wait, 1);
                 if (go && rc) {
                     usleep(10000);
                     mosquitto_reconnect(mosq);
                 }
+                if (reload) {
+                    reload = 0;
+                    reload_config(&mqtta);
+                }
+                if (now_us() >= tick_next) {
+                    control_tick(&mqtta);
+                    tick_next += 1000LL * mqtta.tick_ms;
+                    if (tick_next < now_us()) tick_next = now_us() + 1000LL * mqtta.tick_ms;
+                }
+                if (now_us() >= stale_next) stale_next = check_stale(&mqtta);
+                if (now_us() >= stats_next) {
+                    publish_stats(&mqtta);
+                    stats_next += 1000000LL * STATS_INTERVAL;
+                }
+            }
+#endif
+
+            sprintf(buffer, "%d", INTERVAL_DEFAULT);
+            publish(&mqtta, mqtta.topic_control_update_interval, buffer);
+
+            for (i = 0; i < mqtta.vehicles; i++)
+                if (mqtta.car[i].chargingState == STATE_CHARGING)
+                    publish_command(&mqtta, mqtta.car[i].topic_control_charging, (char*)"stop");
+
+            publish_stats(&mqtta);
+
+            // deliver the final commands before the connection is closed
+            time_t ts_flush = time(NULL);
+            while (mqtta.cmdq_len && (time(NULL) - ts_flush < COMMAND_FLUSH_TIMEOUT)) {
+                if (mosquitto_loop(mosq, 100, 1)) {
+                    usleep(10000);
+                    mosquitto_reconnect(mosq);
+                }
             }
         } else  if (mqtta.verbose) printf("Error: Could not connect to '%s:%d'\n", mqtta.mqtt_host, mqtta.mqtt_port);
 
         mosquitto_disconnect(mosq);
         mosquitto_destroy(mosq);
+        mqtta.mosq = NULL;
     }
 
+    session_close(&mqtta);
+    log_stop();
+
     printf("\n");
 
-    sprintf(buffer, "%d", INTERVAL_DEFAULT);
-    publish(mqtta.cid, mqtta.mqtt_host, mqtta.mqtt_port, mqtta.topic_control_update_interval, buffer, mqtta.qos, mqtta.retain, mqtta.verbose, mqtta.mqtt_user, mqtta.mqtt_password);
+    if (bench_mode == BENCH_E2E) bench_stop(&b);
 
-    if (!strcmp(mqtta.chargingState, "charging"))
-        publish(mqtta.cid, mqtta.mqtt_host, mqtta.mqtt_port, mqtta.topic_control_charging, (char*)"stop", mqtta.qos, mqtta.retain, mqtta.verbose, mqtta.mqtt_user, mqtta.mqtt_password);
+    if (mqtta.publish_count)
+        printf("publish: %ld commands, latency avg %.1f ms max %.1f ms, %ld errors\n", mqtta.publish_count, mqtta.publish_latency_sum_us / 1000.0 / mqtta.publish_count, mqtta.publish_latency_max_us / 1000.0, mqtta.publish_errors);
+    if (mqtta.cmdq_len)
+        printf("publish: %d commands could not be delivered\n", mqtta.cmdq_len);
+    print_command_stats(&mqtta);
 
     mosquitto_lib_cleanup();
 
+    if (mqtta.record) fclose(mqtta.record);
+
+    state_close(&mqtta);
+    shared_close(&mqtta);
+
     destroy_mqttattr(&mqtta);
 
     return(0);